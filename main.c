@@ -1,10 +1,30 @@
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 #define NOB_IMPLEMENTATION
 #define NOB_STRIP_PREFIX
 #include "nob.h"
 #include <raylib.h>
 #include <raymath.h>
 
+#include "spredit_shm.h"
+
 #define DEBUG
 
 #ifdef DEBUG
@@ -50,10 +70,15 @@ const int BUTTON_HEIGHT = MEDIUM_FONT * TEXT_BOX_FACTOR;
 
 const Color BUTTON_COLOR = GRAY;
 
+// drawn in place of sprites whose thumbnail is not decoded yet
+const Color PLACEHOLDER_COLOR = COLOR(0x2C2C2CFF);
+
 const int MARK_LINE_THICK = 5;
 
 const int MAX_PIXEL_SCALE = 15;
 
+const float ONION_ALPHA = 0.3;
+
 void draw_dashed_line(Vector2 start_pos, Vector2 end_pos, float thick,
                       int segments) {
     Vector2 dir = Vector2Subtract(end_pos, start_pos);
@@ -233,16 +258,213 @@ Rectangle get_popup_rect() {
     };
 }
 
-Rectangle setup_screen(const char *text) {
-    DrawText(text, MARGINS, MARGINS, TITLE_BAR * 18 / 20, TEXT_COLOR);
+// Text laid out once per string, font size and width. Drawing a cached layout
+// is a batch of glyph quads without measuring or looking up glyphs, which
+// raylib's DrawText does on every call.
+typedef struct {
+    Rectangle src;
+    // relative to where the text is drawn
+    Rectangle dst;
+} PlacedGlyph;
+
+typedef struct {
+    PlacedGlyph *items;
+    size_t count;
+    size_t capacity;
+} PlacedGlyphs;
+
+typedef struct {
+    // identity of the string, the hash catches buffers edited in place
+    const char *text;
+    uint32_t hash;
+    int size;
+    // 0 for no limit, otherwise overflowing lines end in an ellipsis
+    int max_width;
+    unsigned generation;
+    float width;
+    PlacedGlyphs glyphs;
+} TextLayout;
+
+enum { TEXT_CACHE_SIZE = 4096 };
+// direct mapped, a collision only costs a new layout
+TextLayout TEXT_CACHE[TEXT_CACHE_SIZE];
+// bumped to drop every cached layout, on rename and resize
+unsigned TEXT_GENERATION = 1;
+// raylib's default space between lines
+const int TEXT_LINE_SPACING = 2;
+
+void text_cache_clear() { TEXT_GENERATION++; }
+
+uint32_t text_hash(const char *text) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = text; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+float glyph_advance(Font font, int index, float scale) {
+    if (font.glyphs[index].advanceX == 0) {
+        return font.recs[index].width * scale;
+    }
+    return font.glyphs[index].advanceX * scale;
+}
+
+void place_glyph(TextLayout *layout, Font font, int index, float x, float y,
+                 float scale) {
+    float pad = font.glyphPadding;
+    Rectangle rec = font.recs[index];
+    PlacedGlyph glyph = {
+        .src = {rec.x - pad, rec.y - pad, rec.width + 2 * pad,
+                rec.height + 2 * pad},
+        .dst = {x + (font.glyphs[index].offsetX - pad) * scale,
+                y + (font.glyphs[index].offsetY - pad) * scale,
+                (rec.width + 2 * pad) * scale, (rec.height + 2 * pad) * scale},
+    };
+    da_append(&layout->glyphs, glyph);
+}
+
+// Same metrics as DrawText with the default font.
+void layout_text(TextLayout *layout) {
+    Font font = GetFontDefault();
+    int size = layout->size < 10 ? 10 : layout->size;
+    float scale = (float)size / font.baseSize;
+    int spacing = size / 10;
+    int dot = GetGlyphIndex(font, '.');
+    float dot_advance = glyph_advance(font, dot, scale) + spacing;
+    float max_width = layout->max_width > 0 ? layout->max_width : INFINITY;
+
+    layout->glyphs.count = 0;
+    layout->width = 0;
+    float x = 0;
+    float y = 0;
+    // where the ellipsis goes if the current line turns out too long
+    size_t fit_count = 0;
+    float fit_x = 0;
+    bool skip_line = false;
+    const char *c = layout->text;
+    while (*c) {
+        int bytes = 0;
+        int codepoint = GetCodepointNext(c, &bytes);
+        c += bytes;
+        if (codepoint == '\n') {
+            x = 0;
+            y += size + TEXT_LINE_SPACING;
+            fit_count = layout->glyphs.count;
+            fit_x = 0;
+            skip_line = false;
+            continue;
+        }
+        if (skip_line) {
+            continue;
+        }
+        int index = GetGlyphIndex(font, codepoint);
+        float advance = glyph_advance(font, index, scale) + spacing;
+        if (x + advance - spacing > max_width) {
+            layout->glyphs.count = fit_count;
+            x = fit_x;
+            for (int i = 0; i < 3; i++) {
+                place_glyph(layout, font, dot, x, y, scale);
+                x += dot_advance;
+            }
+            layout->width = fmax(layout->width, x - spacing);
+            skip_line = true;
+            continue;
+        }
+        if (codepoint != ' ' && codepoint != '\t') {
+            place_glyph(layout, font, index, x, y, scale);
+        }
+        x += advance;
+        layout->width = fmax(layout->width, x - spacing);
+        if (x + 3 * dot_advance - spacing <= max_width) {
+            fit_count = layout->glyphs.count;
+            fit_x = x;
+        }
+    }
+}
+
+TextLayout *text_layout(const char *text, int size, int max_width) {
+    uint32_t hash = text_hash(text);
+    uint64_t key = (uintptr_t)text;
+    key = (key ^ (uint64_t)size << 40 ^ (uint64_t)max_width << 20) *
+          0x9E3779B97F4A7C15ull;
+    TextLayout *layout = &TEXT_CACHE[(key >> 32) % TEXT_CACHE_SIZE];
+    if (layout->text != text || layout->hash != hash || layout->size != size ||
+        layout->max_width != max_width ||
+        layout->generation != TEXT_GENERATION) {
+        layout->text = text;
+        layout->hash = hash;
+        layout->size = size;
+        layout->max_width = max_width;
+        layout->generation = TEXT_GENERATION;
+        layout_text(layout);
+    }
+    return layout;
+}
+
+// Drop-in for DrawText, returns the width of the drawn text.
+float draw_text(const char *text, int x, int y, int size, int max_width,
+                Color color) {
+    TextLayout *layout = text_layout(text, size, max_width);
+    Texture2D texture = GetFontDefault().texture;
+    da_foreach(PlacedGlyph, glyph, &layout->glyphs) {
+        Rectangle dst = glyph->dst;
+        dst.x += x;
+        dst.y += y;
+        DrawTexturePro(texture, glyph->src, dst, (Vector2){0}, 0, color);
+    }
+    return layout->width;
+}
+
+// Strings that change rarely, formatted only when one of their values does.
+typedef struct {
+    double values[8];
+    char text[128];
+} CachedString;
+
+bool cached_string_stale(CachedString *string, const double *values,
+                         int count) {
+    if (string->text[0] != '\0' &&
+        memcmp(string->values, values, count * sizeof(double)) == 0) {
+        return false;
+    }
+    memcpy(string->values, values, count * sizeof(double));
+    return true;
+}
+
+void draw_title(const char *text) {
+    draw_text(text, MARGINS, MARGINS, TITLE_BAR * 18 / 20, 0, TEXT_COLOR);
+}
+
+// the area below the title
+Rectangle screen_rect() {
     Rectangle screen = shrink(get_window_rect(), MARGINS);
     screen.y += TITLE_BAR + MARGINS;
     screen.height -= TITLE_BAR + MARGINS;
     return screen;
 }
 
-bool clickable_region(Rectangle rect) {
-    if (CheckCollisionPointRec(GetMousePosition(), rect)) {
+Rectangle setup_screen(const char *text) {
+    draw_title(text);
+    return screen_rect();
+}
+
+bool command_down() {
+    return IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL) ||
+           IsKeyDown(KEY_LEFT_SUPER) || IsKeyDown(KEY_RIGHT_SUPER);
+}
+
+bool shift_down() {
+    return IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+}
+
+bool key_pressed_or_repeat(int key) {
+    return IsKeyPressed(key) || IsKeyPressedRepeat(key);
+}
+
+// hovered is passed in by widgets whose hit test was already done
+bool clickable(Rectangle rect, bool hovered) {
+    if (hovered) {
         DrawRectangleLinesEx(rect, MARK_LINE_THICK, TEXT_COLOR);
         if (IsMouseButtonPressed(0)) {
             return true;
@@ -251,32 +473,144 @@ bool clickable_region(Rectangle rect) {
     return false;
 }
 
-bool button(const char *text, Rectangle rect, Color color) {
+bool clickable_region(Rectangle rect) {
+    return clickable(rect, CheckCollisionPointRec(GetMousePosition(), rect));
+}
+
+bool hovered_button(const char *text, Rectangle rect, Color color,
+                    bool hovered) {
     DrawRectangleRec(rect, color);
     float fontsize = rect.height * 0.8;
-    DrawText(text, rect.x + rect.height * 0.2, rect.y + rect.height * 0.1,
-             fontsize, TEXT_COLOR);
-    return clickable_region(rect);
+    draw_text(text, rect.x + rect.height * 0.2, rect.y + rect.height * 0.1,
+              fontsize, rect.width - rect.height * 0.4, TEXT_COLOR);
+    return clickable(rect, hovered);
 }
 
-// TODO: enhance with macro
-int button_list(Rectangle *rect, char *names[], int count) {
-    int selected = -1;
+bool button(const char *text, Rectangle rect, Color color) {
+    return hovered_button(text, rect, color,
+                          CheckCollisionPointRec(GetMousePosition(), rect));
+}
 
+// Cuts count button rects off the top of rect.
+void button_column(Rectangle *rect, Rectangle *out, int count) {
     for (int i = 0; i < count; i++) {
-        Rectangle r_button = {
+        out[i] = (Rectangle){
             .x = rect->x,
             .y = rect->y,
             .width = rect->width,
             .height = BUTTON_HEIGHT,
         };
-        if (button(names[i], r_button, BUTTON_COLOR)) {
-            selected = i;
-        };
         rect->y += BUTTON_HEIGHT + MARGINS;
         rect->height -= BUTTON_HEIGHT + MARGINS;
     }
+}
+
+// The rectangles of a screen, computed from the window size once and kept
+// until the window is resized. Widgets refer to them by index, and the one
+// under the mouse is found through a coarse grid instead of testing every
+// widget.
+enum { LAYOUT_MAX_RECTS = 32, HIT_CELL_SIZE = 64 };
+
+typedef void (*LayoutBuilder)(Rectangle screen, Rectangle *rects);
+
+typedef struct {
+    LayoutBuilder build;
+    int count;
+    // window size the rects were computed for
+    int width;
+    int height;
+    Rectangle rects[LAYOUT_MAX_RECTS];
+    int columns;
+    int rows;
+    // ids of the rects overlapping grid cell c, later ids are drawn on top
+    // cell_items[cell_start[c]] .. cell_items[cell_start[c + 1] - 1]
+    int *cell_start;
+    struct {
+        int *items;
+        size_t count;
+        size_t capacity;
+    } cell_items;
+    // id of the rect under the mouse this frame, -1 for none
+    int hovered;
+} Layout;
+
+void layout_build(Layout *layout) {
+    layout->width = GetScreenWidth();
+    layout->height = GetScreenHeight();
+    layout->build(screen_rect(), layout->rects);
+
+    layout->columns = layout->width / HIT_CELL_SIZE + 1;
+    layout->rows = layout->height / HIT_CELL_SIZE + 1;
+    int cells = layout->columns * layout->rows;
+    layout->cell_start =
+        realloc(layout->cell_start, (cells + 1) * sizeof(int));
+    if (layout->cell_start == NULL) {
+        TraceLog(LOG_FATAL, "could not allocate layout grid");
+        abort();
+    }
+    layout->cell_items.count = 0;
+    for (int c = 0; c < cells; c++) {
+        layout->cell_start[c] = layout->cell_items.count;
+        Rectangle cell = {
+            .x = (c % layout->columns) * HIT_CELL_SIZE,
+            .y = (c / layout->columns) * HIT_CELL_SIZE,
+            .width = HIT_CELL_SIZE,
+            .height = HIT_CELL_SIZE,
+        };
+        for (int id = 0; id < layout->count; id++) {
+            if (CheckCollisionRecs(cell, layout->rects[id])) {
+                da_append(&layout->cell_items, id);
+            }
+        }
+    }
+    layout->cell_start[cells] = layout->cell_items.count;
+}
+
+int layout_hit(Layout *layout, Vector2 point) {
+    if (point.x < 0 || point.y < 0) {
+        return -1;
+    }
+    int column = point.x / HIT_CELL_SIZE;
+    int row = point.y / HIT_CELL_SIZE;
+    if (column >= layout->columns || row >= layout->rows) {
+        return -1;
+    }
+    int c = row * layout->columns + column;
+    int hit = -1;
+    for (int k = layout->cell_start[c]; k < layout->cell_start[c + 1]; k++) {
+        int id = layout->cell_items.items[k];
+        if (CheckCollisionPointRec(point, layout->rects[id])) {
+            hit = id;
+        }
+    }
+    return hit;
+}
+
+// Called once per frame before the screen is drawn. Every screen keeps its
+// own layout, so a screen that was not shown during a resize still notices
+// the new size.
+Rectangle *layout_begin(Layout *layout) {
+    if (IsWindowResized() || layout->width != GetScreenWidth() ||
+        layout->height != GetScreenHeight()) {
+        layout_build(layout);
+    }
+    layout->hovered = layout_hit(layout, GetMousePosition());
+    return layout->rects;
+}
 
+bool layout_button(Layout *layout, int id, const char *text, Color color) {
+    return hovered_button(text, layout->rects[id], color,
+                          layout->hovered == id);
+}
+
+// returns the index of the clicked button or -1
+int layout_button_list(Layout *layout, int first, char *names[], int count) {
+    int selected = -1;
+    for (int i = 0; i < count; i++) {
+        if (layout_button(layout, first + i, names[i], BUTTON_COLOR)) {
+            selected = i;
+        }
+    }
     return selected;
 }
 
@@ -316,7 +650,7 @@ Rectangle setup_popup(const char *text) {
     Rectangle full = get_popup_rect();
     DrawRectangleRec(full, POPUP_BACKGROUND);
     Rectangle inner = shrink(full, MARGINS);
-    DrawText(text, inner.x, inner.y, SMALL_FONT, TEXT_COLOR);
+    draw_text(text, inner.x, inner.y, SMALL_FONT, inner.width, TEXT_COLOR);
     return inner;
 }
 
@@ -358,7 +692,7 @@ char *string_popup(const char *text, const char *initial_text, int max_len) {
         RectTuple split = chop_bottom(rect, LITTLE_MARGIN * 2 + SMALL_FONT);
         DrawRectangleRec(split.r2, WHITE);
         Rectangle text_field = shrink(split.r2, LITTLE_MARGIN);
-        DrawText(input, text_field.x, text_field.y, SMALL_FONT, BLACK);
+        draw_text(input, text_field.x, text_field.y, SMALL_FONT, 0, BLACK);
 
         EndDrawing();
         int key = GetCharPressed();
@@ -393,9 +727,48 @@ char *string_popup(const char *text, const char *initial_text, int max_len) {
     return input;
 }
 
+const int MAX_NAME_LEN = 64;
+enum { SPRITE_SIZE = 16 };
+enum { SPRITE_BYTES = SPRITE_SIZE * SPRITE_SIZE / 2 };
+
+enum { NUM_COLORS = 16 };
+// palettes per bank, so palette and color index fit into one byte
+enum { MAX_PALETTES = 16 };
+// sprites a bank may hold, 2 GiB of bitmaps, so counts read from a file fit
+// an int with room to grow the sprite list
+enum { MAX_SPRITES = 1 << 24 };
+
+// mip levels of the sprite atlas, see SpriteAtlas
+enum { ATLAS_LEVELS = 4 };
+
+typedef struct {
+    unsigned char pixels[SPRITE_BYTES];
+    bool visible;
+} Layer;
+
+typedef struct {
+    Layer *items;
+    int count;
+    int capacity;
+} LayerList;
+
 typedef struct {
     char *name;
+    // always holds the flattened image, this is what gets saved and drawn
     unsigned char *pixels;
+    // empty for single layer sprites
+    LayerList layers;
+    // stays the same while the sprite moves around in SPRITES
+    unsigned int id;
+    // bumped whenever pixels change, so cached textures know they are stale
+    unsigned int version;
+    // slot in each level of ATLAS, only valid while the slot's owner is this
+    // sprite
+    int slots[ATLAS_LEVELS];
+    // part of the gallery selection
+    bool selected;
+    // index into PALETTES
+    unsigned char palette;
 } Sprite;
 
 typedef struct {
@@ -404,554 +777,6531 @@ typedef struct {
     int capacity;
 } SpriteList;
 
-const int MAX_NAME_LEN = 64;
-enum { SPRITE_SIZE = 16 };
-
-enum { NUM_COLORS = 16 };
-
-Color COLORS[NUM_COLORS] = {0};
+// Palette 0 is the one in the file header, the others are stored after the
+// sprites, see write_palettes. Sprite variants like team colors share their
+// bitmaps and only differ in the palette they point at.
+Color PALETTES[MAX_PALETTES][NUM_COLORS] = {0};
+int PALETTE_COUNT = 1;
+Color *COLORS = PALETTES[0];
 Color NEW_COLORS[NUM_COLORS] = {0};
-Color *DISPLAYCOLORS = &COLORS[0];
+Color *DISPLAYCOLORS = PALETTES[0];
+// bumped whenever any palette changes
+unsigned int PALETTE_VERSION = 1;
+// palette the gallery shows all sprites in, -1 for their own
+int GALLERY_PALETTE = -1;
 
 SpriteList SPRITES = {0};
-bool NAMED = true;
+unsigned int NEXT_SPRITE_ID = 1;
+// versions are never reused, so restoring an old copy of a sprite can't be
+// mistaken for the current one
+unsigned int VERSION_CLOCK = 0;
 
-unsigned char EDIT_BUF[SPRITE_SIZE * SPRITE_SIZE / 2] = {0};
+typedef struct {
+    int *items;
+    int count;
+    int capacity;
+} IntList;
 
-int load_file(const char *path) {
-    FILE *file = fopen(path, "rb");
-    int result = 0;
-    if (!file) {
-        result = -1;
-        TraceLog(LOG_ERROR, "Error opening file: %s", path);
-        goto cleanup;
-    }
-    char magic[5] = {0};
-    if (fread(&magic, 1, 4, file) != 4) {
-        result = -1;
-        TraceLog(LOG_ERROR, "Error reading: %s", path);
-        goto cleanup;
-    }
-    bool magic_ok = false;
-    bool has_names;
-    if (strcmp(magic, "sprt") == 0) {
-        TraceLog(LOG_INFO, "reading %s as named sprite");
-        has_names = true;
-        magic_ok = true;
+// Publishes the store into POSIX shared memory for a running game, see
+// spredit_shm.h for the layout. Whatever changes the store marks the records
+// it changed, and only those are written on the next frame, so a save shows
+// up in the game right away without a walk over the whole store.
+typedef struct {
+    // shm object name, NULL when not publishing
+    const char *name;
+    SpreditShm *shm;
+    size_t size;
+    // records changed in place, see shm_mark
+    IntList dirty;
+    // every record from here on, after sprites were inserted, removed or
+    // moved, see shm_mark_moved
+    int moved_from;
+} ShmPublisher;
+
+ShmPublisher SHM = {.moved_from = INT_MAX};
+
+void shm_mark(int index) {
+    if (SHM.shm != NULL && index < SHM.moved_from) {
+        da_append(&SHM.dirty, index);
     }
-    if (strcmp(magic, "spru") == 0) {
-        TraceLog(LOG_INFO, "reading %s as named sprite");
-        has_names = false;
-        magic_ok = true;
+}
+
+void shm_mark_moved(int index) {
+    if (index < SHM.moved_from) {
+        SHM.moved_from = index;
     }
-    if (!magic_ok) {
-        result = -1;
-        TraceLog(LOG_ERROR, "%s is not a sprite file", path);
-        goto cleanup;
+}
+
+void touch_sprite(Sprite *sprite) {
+    sprite->version = ++VERSION_CLOCK;
+    // sprites still being built are not in the store yet
+    if (sprite >= SPRITES.items && sprite < SPRITES.items + SPRITES.count) {
+        shm_mark(sprite - SPRITES.items);
     }
+}
 
-    NAMED = has_names;
+int shown_palette(const Sprite *sprite) {
+    return GALLERY_PALETTE >= 0 ? GALLERY_PALETTE : sprite->palette;
+}
+bool NAMED = true;
 
-    uint32_t r_count = 0;
-    if (fread(&r_count, sizeof(uint32_t), 1, file) != 1) {
-        result = -1;
-        TraceLog(LOG_ERROR, "Error reading: %s", path);
-        goto cleanup;
+unsigned char EDIT_BUF[SPRITE_SIZE * SPRITE_SIZE / 2] = {0};
+
+// nibbles with this color index let the layers below show through
+unsigned char TRANSPARENT_INDEX = 0;
+
+// A sprite row is 16 nibbles, which fits exactly into one 64 bit word. Pixel x
+// of a row lives in bits 4x..4x+3, the same order as in the file.
+enum { ROW_BYTES = SPRITE_SIZE / 2 };
+const uint64_t NIBBLE_ONES = 0x1111111111111111ULL;
+
+uint64_t load_row(const unsigned char *row) {
+    uint64_t word = 0;
+    for (int i = 0; i < ROW_BYTES; i++) {
+        word |= (uint64_t)row[i] << (8 * i);
     }
-    int count = r_count;
-    if (fread(&COLORS, sizeof(Color), NUM_COLORS, file) != NUM_COLORS) {
-        result = -1;
-        TraceLog(LOG_ERROR, "Error reading: %s", path);
-        goto cleanup;
+    return word;
+}
+
+void store_row(unsigned char *row, uint64_t word) {
+    for (int i = 0; i < ROW_BYTES; i++) {
+        row[i] = word >> (8 * i) & 0xFF;
     }
+}
 
-    da_reserve(&SPRITES, count);
-    for (int i = 0; i < count; i++) {
-        char *name = malloc(MAX_NAME_LEN);
-        if (has_names) {
-            if (fread(name, 1, MAX_NAME_LEN, file) != MAX_NAME_LEN) {
-                free(name);
-                result = -1;
-                TraceLog(LOG_ERROR, "Error reading: %s", path);
-                goto cleanup;
-            }
-            name[MAX_NAME_LEN - 1] = '\0';
-        } else {
-            snprintf(name, MAX_NAME_LEN, "%d", i);
-        }
-        char *temp = realloc(name, strlen(name) + 1);
-        if (temp == NULL) {
-            free(name);
-            result = -1;
-            TraceLog(LOG_ERROR,
-                     "Error reading: %s\ncould not shrink string buffer", path);
-            goto cleanup;
-        }
-        name = temp;
+// 0xF in every nibble that is not the given color index, 0x0 otherwise
+uint64_t opaque_mask(uint64_t row, unsigned char index) {
+    uint64_t diff = row ^ (NIBBLE_ONES * index);
+    diff |= diff >> 1;
+    diff |= diff >> 2;
+    return (diff & NIBBLE_ONES) * 0xF;
+}
 
-        unsigned char *pixels = malloc(SPRITE_SIZE * SPRITE_SIZE / 2);
-        if (fread(pixels, 1, SPRITE_SIZE * SPRITE_SIZE / 2, file) !=
-            SPRITE_SIZE * SPRITE_SIZE / 2) {
-            free(name);
-            free(pixels);
-            result = -1;
-            TraceLog(LOG_ERROR, "Error reading: %s", path);
-            goto cleanup;
-        }
-        Sprite sprite = {.name = name, .pixels = pixels};
-        da_append(&SPRITES, sprite);
+void fill_transparent(unsigned char *dst) {
+    memset(dst, TRANSPARENT_INDEX * 0x11, SPRITE_BYTES);
+}
+
+// draws src over dst, skipping nibbles that hold TRANSPARENT_INDEX
+void blend_layer(unsigned char *dst, const unsigned char *src) {
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        uint64_t s = load_row(src + y * ROW_BYTES);
+        uint64_t d = load_row(dst + y * ROW_BYTES);
+        uint64_t mask = opaque_mask(s, TRANSPARENT_INDEX);
+        store_row(dst + y * ROW_BYTES, (d & ~mask) | (s & mask));
     }
+}
 
-    memcpy(&NEW_COLORS, &COLORS, NUM_COLORS * sizeof(Color));
+// 0xF in the nibbles of columns x..x+width-1
+uint64_t column_mask(int x, int width) {
+    uint64_t mask = width >= SPRITE_SIZE ? ~0ULL : (1ULL << 4 * width) - 1;
+    return mask << 4 * x;
+}
 
-cleanup:
-    if (file) {
-        if (fclose(file) != 0) {
-            TraceLog(LOG_ERROR, "Error closing file: %s", path);
-            if (result == 0) {
-                result = -1;
-            }
-        }
+// Clips one axis of a copy of length len from start a to start b so that
+// both ranges lie within a sprite.
+bool clip_span(int *a, int *b, int *len) {
+    int before = -(*a < *b ? *a : *b);
+    if (before > 0) {
+        *a += before;
+        *b += before;
+        *len -= before;
     }
+    int after = (*a > *b ? *a : *b) + *len - SPRITE_SIZE;
+    if (after > 0) {
+        *len -= after;
+    }
+    return *len > 0;
+}
 
-    return result;
+bool clip_rect(int *sx, int *sy, int *dx, int *dy, int *w, int *h) {
+    return clip_span(sx, dx, w) && clip_span(sy, dy, h);
 }
 
-void unload_sprites() {
-    da_foreach(Sprite, s, &SPRITES) {
-        free(s->name);
-        free(s->pixels);
+// Copies the w x h rectangle at (sx, sy) of src to (dx, dy) of dst. Both are
+// sprite sized buffers and may be the same. Each row is moved as one word,
+// odd nibble offsets are just a shift by 4 bits. With skip_transparent set,
+// nibbles holding TRANSPARENT_INDEX in src leave dst untouched.
+void blit_rect(unsigned char *dst, int dx, int dy, const unsigned char *src,
+               int sx, int sy, int w, int h, bool skip_transparent) {
+    if (!clip_rect(&sx, &sy, &dx, &dy, &w, &h)) {
+        return;
+    }
+    uint64_t columns = column_mask(dx, w);
+    int shift = 4 * (dx - sx);
+    // walk bottom up when moving down within the same buffer
+    int step = dy > sy ? -1 : 1;
+    int start = dy > sy ? h - 1 : 0;
+    for (int row = start; row >= 0 && row < h; row += step) {
+        uint64_t s = load_row(src + (sy + row) * ROW_BYTES);
+        s = shift >= 0 ? s << shift : s >> -shift;
+        uint64_t mask = columns;
+        if (skip_transparent) {
+            mask &= opaque_mask(s, TRANSPARENT_INDEX);
+        }
+        unsigned char *d_row = dst + (dy + row) * ROW_BYTES;
+        store_row(d_row, (load_row(d_row) & ~mask) | (s & mask));
     }
-    da_free(SPRITES);
-    SPRITES = (SpriteList){0};
 }
 
-int write_file(const char *path) {
-    FILE *file = fopen(path, "wb");
-    int result = 0;
-    if (!file) {
-        TraceLog(LOG_ERROR, "Error creating file %s", path);
-        result = -1;
-        goto cleanup;
+void fill_rect(unsigned char *dst, int x, int y, int w, int h,
+               unsigned char index) {
+    int sx = x, sy = y;
+    if (!clip_rect(&sx, &sy, &x, &y, &w, &h)) {
+        return;
     }
-    char magic[] = "sprt";
-    if (!NAMED) {
-        magic[3] = 'u';
+    uint64_t mask = column_mask(x, w);
+    uint64_t fill = NIBBLE_ONES * index;
+    for (int row = y; row < y + h; row++) {
+        unsigned char *d_row = dst + row * ROW_BYTES;
+        store_row(d_row, (load_row(d_row) & ~mask) | (fill & mask));
     }
-    if (fprintf(file, "%s", magic) != 4) {
-        TraceLog(LOG_ERROR, "Error writing file: %s");
-        result = -1;
-        goto cleanup;
+}
+
+typedef enum {
+    TRANSFORM_FLIP_H,
+    TRANSFORM_FLIP_V,
+    TRANSFORM_ROTATE_CW,
+    TRANSFORM_ROTATE_CCW,
+    TRANSFORM_SHIFT_LEFT,
+    TRANSFORM_SHIFT_RIGHT,
+    TRANSFORM_SHIFT_UP,
+    TRANSFORM_SHIFT_DOWN,
+} Transform;
+
+// reverses the order of the 16 pixels in a row
+uint64_t mirror_row(uint64_t row) {
+    row = (row >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (row & 0x0F0F0F0F0F0F0F0FULL) << 4;
+    return __builtin_bswap64(row);
+}
+
+void rotate_pixels(unsigned char *pixels, bool clockwise) {
+    uint64_t rows[SPRITE_SIZE];
+    uint64_t out[SPRITE_SIZE] = {0};
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        rows[y] = load_row(pixels + y * ROW_BYTES);
     }
-    uint32_t count = SPRITES.count;
-    if (fwrite(&count, sizeof(uint32_t), 1, file) != 1) {
-        TraceLog(LOG_ERROR, "Error writing file: %s");
-        result = -1;
-        goto cleanup;
+    // clockwise: out[y][x] = in[15 - x][y], counter: out[y][x] = in[x][15 - y]
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        for (int x = 0; x < SPRITE_SIZE; x++) {
+            uint64_t src = clockwise ? rows[SPRITE_SIZE - 1 - x] >> 4 * y
+                                     : rows[x] >> 4 * (SPRITE_SIZE - 1 - y);
+            out[y] |= (src & 0xF) << 4 * x;
+        }
+    }
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        store_row(pixels + y * ROW_BYTES, out[y]);
     }
+}
 
-    if (fwrite(&COLORS, sizeof(Color), NUM_COLORS, file) != NUM_COLORS) {
-        TraceLog(LOG_ERROR, "Error writing file: %s");
-        result = -1;
-        goto cleanup;
+// rotates the rows by amount, positive moves them down
+void roll_rows(unsigned char *pixels, int amount) {
+    unsigned char copy[SPRITE_BYTES];
+    memcpy(copy, pixels, SPRITE_BYTES);
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        int from = (y - amount + SPRITE_SIZE) % SPRITE_SIZE;
+        memcpy(pixels + y * ROW_BYTES, copy + from * ROW_BYTES, ROW_BYTES);
     }
-    for (int i = 0; i < SPRITES.count; i++) {
-        Sprite sprite = SPRITES.items[i];
-        if (NAMED) {
-            size_t name_len = strlen(sprite.name);
-            size_t padding_len = MAX_NAME_LEN - name_len;
-            size_t written_content = fwrite(sprite.name, 1, name_len, file);
-            if (written_content != name_len) {
-                TraceLog(LOG_ERROR, "Error writing file: %s");
-                result = -1;
-                goto cleanup;
-            }
-            if (padding_len > 0) {
-                char zero_byte = 0;
-                for (size_t i = 0; i < padding_len; i++) {
-                    if (fwrite(&zero_byte, 1, 1, file) != 1) {
-                        TraceLog(LOG_ERROR, "Error writing file: %s");
-                        result = -1;
-                        goto cleanup;
-                    }
-                }
-            }
+}
+
+void transform_pixels(unsigned char *pixels, Transform transform) {
+    switch (transform) {
+    case TRANSFORM_FLIP_H:
+        for (int y = 0; y < SPRITE_SIZE; y++) {
+            unsigned char *row = pixels + y * ROW_BYTES;
+            store_row(row, mirror_row(load_row(row)));
         }
-        size_t bytes_sent =
-            fwrite(sprite.pixels, 1, SPRITE_SIZE * SPRITE_SIZE / 2, file);
-        if (bytes_sent != SPRITE_SIZE * SPRITE_SIZE / 2) {
-            TraceLog(LOG_ERROR, "Error writing file: %s");
-            result = -1;
-            goto cleanup;
+        break;
+    case TRANSFORM_FLIP_V:
+        for (int y = 0; y < SPRITE_SIZE / 2; y++) {
+            unsigned char tmp[ROW_BYTES];
+            unsigned char *top = pixels + y * ROW_BYTES;
+            unsigned char *bottom = pixels + (SPRITE_SIZE - 1 - y) * ROW_BYTES;
+            memcpy(tmp, top, ROW_BYTES);
+            memcpy(top, bottom, ROW_BYTES);
+            memcpy(bottom, tmp, ROW_BYTES);
+        }
+        break;
+    case TRANSFORM_ROTATE_CW:
+    case TRANSFORM_ROTATE_CCW:
+        rotate_pixels(pixels, transform == TRANSFORM_ROTATE_CW);
+        break;
+    case TRANSFORM_SHIFT_LEFT:
+    case TRANSFORM_SHIFT_RIGHT:
+        for (int y = 0; y < SPRITE_SIZE; y++) {
+            unsigned char *row = pixels + y * ROW_BYTES;
+            uint64_t word = load_row(row);
+            // pixel 0 is in the low nibble, so moving right is a left shift
+            if (transform == TRANSFORM_SHIFT_RIGHT) {
+                word = word << 4 | word >> 60;
+            } else {
+                word = word >> 4 | word << 60;
+            }
+            store_row(row, word);
         }
+        break;
+    case TRANSFORM_SHIFT_UP:
+        roll_rows(pixels, -1);
+        break;
+    case TRANSFORM_SHIFT_DOWN:
+        roll_rows(pixels, 1);
+        break;
     }
+}
 
-cleanup:
-    if (file) {
-        if (fclose(file) != 0) {
-            TraceLog(LOG_ERROR, "Error closing file: %s", path);
-            if (result == 0)
-                result = -1;
+void flatten_layers(unsigned char *dst, LayerList *layers) {
+    fill_transparent(dst);
+    da_foreach(Layer, layer, layers) {
+        if (layer->visible) {
+            blend_layer(dst, layer->pixels);
         }
     }
-
-    return result;
 }
 
-void draw_sprite(unsigned char *sprite, int pixel_width, int left, int top) {
-    if (sprite == NULL) {
-        return;
-    }
-    for (int i = 0; i < SPRITE_SIZE * SPRITE_SIZE; i++) {
-        int idx = i / 2;
-        int color_idx;
-        if (i % 2 == 0) {
-            color_idx = sprite[idx] & 0x0F;
-        } else {
-            color_idx = sprite[idx] >> 4 & 0x0F;
+// The layers being edited. Everything below and above the active layer is
+// pre-blended, so a stroke on the active layer only costs two blends no matter
+// how deep the stack is.
+LayerList EDIT_LAYERS = {0};
+int ACTIVE_LAYER = 0;
+unsigned char LAYERS_BELOW[SPRITE_BYTES] = {0};
+unsigned char LAYERS_ABOVE[SPRITE_BYTES] = {0};
+
+// call after changing the active layer, visibility or the stack itself
+void rebuild_layer_cache() {
+    fill_transparent(LAYERS_BELOW);
+    fill_transparent(LAYERS_ABOVE);
+    for (int i = 0; i < EDIT_LAYERS.count; i++) {
+        Layer *layer = &EDIT_LAYERS.items[i];
+        if (i == ACTIVE_LAYER || !layer->visible) {
+            continue;
         }
-        int x = i % 16;
-        int y = i / 16;
-        DrawRectangle(left + x * pixel_width, top + y * pixel_width,
-                      pixel_width, pixel_width, DISPLAYCOLORS[color_idx]);
+        blend_layer(i < ACTIVE_LAYER ? LAYERS_BELOW : LAYERS_ABOVE,
+                    layer->pixels);
     }
 }
 
-void rgbaslider(Rectangle rect, unsigned char *component, char *name) {
-    RectTuple split = vsplit(rect, 1, 4);
-    DrawText(name, split.r1.x, split.r1.y, 0.8 * split.r1.height, TEXT_COLOR);
-    float r = slider_region(split.r2, *component / 255.0);
-    if (r != -1) {
-        *component = 255.0 * r;
+// call after painting on the active layer, writes the result to EDIT_BUF
+void composite_edit_layers() {
+    memcpy(&EDIT_BUF, &LAYERS_BELOW, SPRITE_BYTES);
+    Layer *active = &EDIT_LAYERS.items[ACTIVE_LAYER];
+    if (active->visible) {
+        blend_layer(EDIT_BUF, active->pixels);
     }
+    blend_layer(EDIT_BUF, LAYERS_ABOVE);
 }
 
-void color_sliders(Color *color, Rectangle rect) {
-    RectTuple split = chop_top(rect, TITLE_BAR);
-    DrawText(
-        TextFormat("#%02X%02X%02X%02X", color->r, color->g, color->b, color->a),
-        rect.x, rect.y, TITLE_BAR * 15 / 20, WHITE);
+void begin_layer_edit(Sprite *sprite) {
+    EDIT_LAYERS.count = 0;
+    if (sprite->layers.count == 0) {
+        Layer base = {.visible = true};
+        memcpy(base.pixels, sprite->pixels, SPRITE_BYTES);
+        da_append(&EDIT_LAYERS, base);
+    } else {
+        da_append_many(&EDIT_LAYERS, sprite->layers.items,
+                       sprite->layers.count);
+    }
+    ACTIVE_LAYER = EDIT_LAYERS.count - 1;
+    rebuild_layer_cache();
+    composite_edit_layers();
+}
 
-    rgbaslider(vsubdivide(split.r2, 4, 0), &color->r, "R");
-    rgbaslider(vsubdivide(split.r2, 4, 1), &color->g, "G");
-    rgbaslider(vsubdivide(split.r2, 4, 2), &color->b, "B");
-    rgbaslider(vsubdivide(split.r2, 4, 3), &color->a, "A");
+// flattens the edited layers into the sprite, keeping the stack around only
+// if there is more than one layer
+void commit_layer_edit(Sprite *sprite) {
+    memcpy(sprite->pixels, &EDIT_BUF, SPRITE_BYTES);
+    touch_sprite(sprite);
+    sprite->layers.count = 0;
+    if (EDIT_LAYERS.count > 1) {
+        da_append_many(&sprite->layers, EDIT_LAYERS.items, EDIT_LAYERS.count);
+    } else if (sprite->layers.capacity > 0) {
+        da_free(sprite->layers);
+        sprite->layers = (LayerList){0};
+    }
 }
 
-void color_selector(Rectangle rect, int *selected, Color *colors) {
-    rect = fit_square_factor(rect, 8);
-    if (IsKeyPressed(KEY_ESCAPE)) {
-        *selected = -1;
+void transform_sprite(Sprite *sprite, Transform transform) {
+    transform_pixels(sprite->pixels, transform);
+    da_foreach(Layer, layer, &sprite->layers) {
+        transform_pixels(layer->pixels, transform);
     }
-    for (int i = 0; i < NUM_COLORS; i++) {
-        int x = i % 4;
-        int y = i / 4;
-        Rectangle colorpad = {
-            .x = rect.x + x * rect.width / 4,
-            .y = rect.y + y * rect.height / 4,
-            .width = rect.width / 4,
-            .height = rect.height / 4,
-        };
-        DrawRectangleRec(colorpad, colors[i]);
+    touch_sprite(sprite);
+}
 
-        Color opaque = colors[i];
-        opaque.a = 0xFF;
-        Rectangle opaque_r = (Rectangle){
-            rect.x + x * rect.width / 4,
-            rect.y + y * rect.height / 4,
-            rect.width / 8,
-            rect.height / 8,
+void transform_sprites(const int *indices, int count, Transform transform) {
+    for (int i = 0; i < count; i++) {
+        transform_sprite(&SPRITES.items[indices[i]], transform);
+    }
+}
+
+// keys for the transforms, without modifiers
+const int TRANSFORM_KEYS[] = {
+    [TRANSFORM_FLIP_H] = KEY_H,         [TRANSFORM_FLIP_V] = KEY_V,
+    [TRANSFORM_ROTATE_CW] = KEY_R,      [TRANSFORM_ROTATE_CCW] = KEY_E,
+    [TRANSFORM_SHIFT_LEFT] = KEY_LEFT,  [TRANSFORM_SHIFT_RIGHT] = KEY_RIGHT,
+    [TRANSFORM_SHIFT_UP] = KEY_UP,      [TRANSFORM_SHIFT_DOWN] = KEY_DOWN,
+};
+
+// returns the transform requested this frame or -1
+int transform_pressed() {
+    if (command_down()) {
+        return -1;
+    }
+    for (int i = 0; i < (int)ARRAY_LEN(TRANSFORM_KEYS); i++) {
+        if (key_pressed_or_repeat(TRANSFORM_KEYS[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void append_le32(String_Builder *out, uint32_t value) {
+    unsigned char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+    sb_append_buf(out, bytes, 4);
+}
+
+void append_le64(String_Builder *out, uint64_t value) {
+    append_le32(out, value);
+    append_le32(out, value >> 32);
+}
+
+// Explicit little endian loads and stores, which compilers turn into plain
+// moves on little endian machines, and work at any alignment.
+uint32_t load_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint64_t load_le64(const unsigned char *p) {
+    return load_le32(p) | (uint64_t)load_le32(p + 4) << 32;
+}
+
+void store_le32(unsigned char *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+// Reads from a buffer for the file parsers. Reading past the end yields
+// NULL or 0 and sets failed, so a parser checks once after a run of reads
+// instead of after every field.
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t at;
+    bool failed;
+} Cursor;
+
+size_t cursor_left(const Cursor *in) {
+    return in->failed ? 0 : in->size - in->at;
+}
+
+// the next size bytes, or NULL if there are fewer left
+const unsigned char *cursor_bytes(Cursor *in, uint64_t size) {
+    if (size > cursor_left(in)) {
+        in->failed = true;
+        return NULL;
+    }
+    const unsigned char *bytes = in->data + in->at;
+    in->at += size;
+    return bytes;
+}
+
+uint32_t cursor_le32(Cursor *in) {
+    const unsigned char *bytes = cursor_bytes(in, 4);
+    return bytes ? load_le32(bytes) : 0;
+}
+
+uint64_t cursor_le64(Cursor *in) {
+    const unsigned char *bytes = cursor_bytes(in, 8);
+    return bytes ? load_le64(bytes) : 0;
+}
+
+// a cursor over size bytes at offset from the start of in, failed if they
+// are not all inside
+Cursor cursor_range(const Cursor *in, uint64_t offset, uint64_t size) {
+    if (offset > in->size || size > in->size - offset) {
+        return (Cursor){.failed = true};
+    }
+    return (Cursor){.data = in->data + offset, .size = size};
+}
+
+// CRC32C (Castagnoli), with the SSE 4.2 or ARMv8 CRC instructions where the
+// CPU has them and slicing by 8 elsewhere. Pass 0 or the result of the last
+// call to continue over more data.
+uint32_t CRC32C_TABLE[8][256];
+pthread_once_t CRC32C_ONCE = PTHREAD_ONCE_INIT;
+
+void crc32c_init_table() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc >> 1 ^ (crc & 1 ? 0x82F63B78u : 0);
+        }
+        CRC32C_TABLE[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = CRC32C_TABLE[k - 1][i];
+            CRC32C_TABLE[k][i] = prev >> 8 ^ CRC32C_TABLE[0][prev & 0xFF];
+        }
+    }
+}
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t size) {
+    uint32_t(*t)[256] = CRC32C_TABLE;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint32_t low = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+                              (uint32_t)p[3] << 24);
+        crc = t[7][low & 0xFF] ^ t[6][low >> 8 & 0xFF] ^
+              t[5][low >> 16 & 0xFF] ^ t[4][low >> 24] ^ t[3][p[4]] ^
+              t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; size > 0; p++, size--) {
+        crc = crc >> 8 ^ t[0][(crc ^ *p) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t size) {
+    uint64_t wide = crc;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = wide;
+    for (; size > 0; p++, size--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+uint32_t crc32c_arm(uint32_t crc, const unsigned char *p, size_t size) {
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; p++, size--) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    crc = ~crc;
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc = crc32c_arm(crc, data, size);
+#else
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, data, size);
+    }
+#endif
+    pthread_once(&CRC32C_ONCE, crc32c_init_table);
+    crc = crc32c_table(crc, data, size);
+#endif
+    return ~crc;
+}
+
+// Version 1 banks are the 72 byte header with magic, sprite count and
+// palette, the records, and for banks with several palettes the palette
+// trailer:
+//
+//     char magic[4] = "spal"
+//     uint32 version = 1
+//     uint32 palette_count, including palette 0 from the header
+//     Color palettes[palette_count - 1][16]
+//     uint8 palette of every sprite
+//
+// Banks with a single palette leave it out, so they stay byte for byte what
+// the first versions wrote, and those stop reading before it.
+//
+// Version 2 banks start with a header and a table of sections:
+//
+//     char magic[4] = "spr2"
+//     uint32 version = 3, 2 in banks with 64 byte name slots
+//     uint32 flags, BANK_NAMED if the sprites have names
+//     uint32 sprite_count
+//     uint32 section_count
+//     uint32 header_crc, of the header up to here and the section table
+//     struct {
+//         char id[4];
+//         uint32 crc;
+//         uint64 offset, from the start of the file
+//         uint64 size;
+//     } sections[section_count]
+//
+// Every checksum is a CRC32C, so damage shows before anything is loaded.
+// The sections are
+//
+//     "PALS" Color palettes[palette_count][16]
+//     "SPAL" uint8 palette of every sprite, left out if all use palette 0
+//     "NAME" uint32 offsets[sprite_count + 1], then the names back to back
+//            without terminators, only in named banks. Name i runs from
+//            offsets[i] to offsets[i + 1], counted from the end of offsets.
+//            Version 2 has char names[sprite_count][64] instead.
+//     "BMAP" unsigned char bitmaps[sprite_count][128]
+//
+// Names and bitmaps each sit in one piece, so reading only the bitmaps for
+// thumbnails or only the names for a search touches nothing else. Sections
+// start on cache lines, and bitmaps of 64 KiB or more on a page, so they can
+// be mapped on their own. Small banks don't grow by a page for it. Readers
+// skip sections they don't know, so later versions can add some, like
+// animations, without breaking older ones.
+enum {
+    BANK_HEADER_BYTES = 8 + NUM_COLORS * sizeof(Color),
+    PALETTE_TRAILER_VERSION = 1,
+    BANK_V2_HEADER_BYTES = 24,
+    BANK_SECTION_BYTES = 24,
+    BANK_SECTION_ALIGN = 64,
+    BANK_BITMAP_ALIGN = 4096,
+    // bitmaps smaller than this only get BANK_SECTION_ALIGN
+    BANK_BITMAP_ALIGN_MIN = 16 * BANK_BITMAP_ALIGN,
+    // of spr2 banks with a string table
+    BANK_V2_VERSION = 3,
+    BANK_NAMED = 1,
+};
+
+// version new banks are saved in
+int SAVE_VERSION = 2;
+
+// A bank checked and taken apart in memory, pointing into its bytes.
+typedef struct {
+    int version;
+    bool named;
+    int count;
+    // record i has its name at names + i * name_stride, or where
+    // name_offsets says in a string table, names is NULL if unnamed, and its
+    // bitmap at pixels + i * pixel_stride
+    const unsigned char *names;
+    int name_stride;
+    const unsigned char *name_offsets;
+    const unsigned char *pixels;
+    int pixel_stride;
+    int palette_count;
+    const unsigned char *palettes[MAX_PALETTES];
+    // NULL if every sprite uses palette 0
+    const unsigned char *palette_indices;
+    // why parsing failed
+    const char *error;
+} Bank;
+
+bool bank_error(Bank *bank, const char *error) {
+    bank->error = error;
+    return false;
+}
+
+bool parse_bank_v1(Cursor *in, Bank *bank) {
+    uint32_t count = cursor_le32(in);
+    const unsigned char *palette =
+        cursor_bytes(in, NUM_COLORS * sizeof(Color));
+    if (in->failed) {
+        return bank_error(bank, "truncated header");
+    }
+    if (count > MAX_SPRITES) {
+        return bank_error(bank, "too many sprites");
+    }
+    int record = SPRITE_BYTES + (bank->named ? MAX_NAME_LEN : 0);
+    if (count > cursor_left(in) / record) {
+        return bank_error(bank, "truncated sprites");
+    }
+    const unsigned char *records = cursor_bytes(in, (size_t)count * record);
+    bank->version = 1;
+    bank->count = count;
+    bank->names = bank->named ? records : NULL;
+    bank->name_stride = record;
+    bank->pixels = records + (bank->named ? MAX_NAME_LEN : 0);
+    bank->pixel_stride = record;
+    bank->palette_count = 1;
+    bank->palettes[0] = palette;
+
+    if (cursor_left(in) < 4 || memcmp(in->data + in->at, "spal", 4) != 0) {
+        if (cursor_left(in) > 0) {
+            TraceLog(LOG_WARNING, "ignoring unknown data after the sprites");
+        }
+        return true;
+    }
+    cursor_bytes(in, 4);
+    uint32_t version = cursor_le32(in);
+    uint32_t palette_count = cursor_le32(in);
+    if (in->failed) {
+        return bank_error(bank, "truncated palettes");
+    }
+    if (version != PALETTE_TRAILER_VERSION || palette_count < 1 ||
+        palette_count > MAX_PALETTES) {
+        return bank_error(bank, "unknown palette trailer");
+    }
+    const unsigned char *palettes =
+        cursor_bytes(in, (palette_count - 1) * NUM_COLORS * sizeof(Color));
+    const unsigned char *indices = cursor_bytes(in, count);
+    if (in->failed) {
+        return bank_error(bank, "truncated palettes");
+    }
+    bank->palette_count = palette_count;
+    for (int p = 1; p < bank->palette_count; p++) {
+        bank->palettes[p] = palettes + (p - 1) * NUM_COLORS * sizeof(Color);
+    }
+    bank->palette_indices = indices;
+    return true;
+}
+
+bool parse_bank_v2(Cursor *in, Bank *bank) {
+    uint32_t version = cursor_le32(in);
+    uint32_t flags = cursor_le32(in);
+    uint32_t count = cursor_le32(in);
+    uint32_t section_count = cursor_le32(in);
+    size_t checked = in->at;
+    uint32_t header_crc = cursor_le32(in);
+    if (in->failed) {
+        return bank_error(bank, "truncated header");
+    }
+    if (version != 2 && version != BANK_V2_VERSION) {
+        return bank_error(bank, "unsupported version");
+    }
+    if (count > MAX_SPRITES) {
+        return bank_error(bank, "too many sprites");
+    }
+    if (section_count > cursor_left(in) / BANK_SECTION_BYTES) {
+        return bank_error(bank, "truncated section table");
+    }
+    const unsigned char *table =
+        cursor_bytes(in, section_count * BANK_SECTION_BYTES);
+    uint32_t crc = crc32c(crc32c(0, in->data, checked), table,
+                          section_count * BANK_SECTION_BYTES);
+    if (crc != header_crc) {
+        return bank_error(bank, "damaged header");
+    }
+    bank->version = 2;
+    bank->named = flags & BANK_NAMED;
+    bank->count = count;
+    bank->name_stride = MAX_NAME_LEN;
+    bank->pixel_stride = SPRITE_BYTES;
+
+    Cursor entries = {
+        .data = table,
+        .size = section_count * BANK_SECTION_BYTES,
+    };
+    for (uint32_t s = 0; s < section_count; s++) {
+        const unsigned char *id = cursor_bytes(&entries, 4);
+        uint32_t section_crc = cursor_le32(&entries);
+        uint64_t offset = cursor_le64(&entries);
+        uint64_t size = cursor_le64(&entries);
+        Cursor section = cursor_range(in, offset, size);
+        if (section.failed) {
+            return bank_error(bank, "section outside the file");
+        }
+        if (crc32c(0, section.data, size) != section_crc) {
+            return bank_error(bank, "damaged section");
+        }
+        if (memcmp(id, "PALS", 4) == 0) {
+            uint64_t palettes = size / (NUM_COLORS * sizeof(Color));
+            if (size % (NUM_COLORS * sizeof(Color)) != 0 || palettes < 1 ||
+                palettes > MAX_PALETTES) {
+                return bank_error(bank, "bad palette section");
+            }
+            bank->palette_count = palettes;
+            for (int p = 0; p < bank->palette_count; p++) {
+                bank->palettes[p] =
+                    cursor_bytes(&section, NUM_COLORS * sizeof(Color));
+            }
+        } else if (memcmp(id, "SPAL", 4) == 0) {
+            if (size != count) {
+                return bank_error(bank, "bad sprite palette section");
+            }
+            bank->palette_indices = section.data;
+        } else if (memcmp(id, "NAME", 4) == 0 && version == 2) {
+            if (size != (uint64_t)count * MAX_NAME_LEN) {
+                return bank_error(bank, "bad name section");
+            }
+            bank->names = section.data;
+        } else if (memcmp(id, "NAME", 4) == 0) {
+            const unsigned char *offsets =
+                cursor_bytes(&section, ((size_t)count + 1) * sizeof(uint32_t));
+            if (section.failed) {
+                return bank_error(bank, "bad name section");
+            }
+            uint32_t end = 0;
+            for (uint32_t i = 0; i <= count; i++) {
+                uint32_t next = load_le32(offsets + i * sizeof(uint32_t));
+                if (next < end || next > cursor_left(&section)) {
+                    return bank_error(bank, "bad name section");
+                }
+                end = next;
+            }
+            bank->name_offsets = offsets;
+            bank->names = section.data + section.at;
+        } else if (memcmp(id, "BMAP", 4) == 0) {
+            if (size != (uint64_t)count * SPRITE_BYTES) {
+                return bank_error(bank, "bad bitmap section");
+            }
+            bank->pixels = section.data;
+        }
+    }
+    if (bank->palette_count == 0 || bank->pixels == NULL ||
+        (bank->named && bank->names == NULL)) {
+        return bank_error(bank, "missing sections");
+    }
+    if (!bank->named) {
+        bank->names = NULL;
+    }
+    return true;
+}
+
+// Checks the whole file before anything is loaded from it. False if it is no
+// bank or is damaged, a tool still writing it gets another chance on its
+// next write.
+bool parse_bank(const unsigned char *data, size_t size, Bank *bank) {
+    *bank = (Bank){0};
+    Cursor in = {.data = data, .size = size};
+    const unsigned char *magic = cursor_bytes(&in, 4);
+    if (magic == NULL) {
+        return bank_error(bank, "not a sprite file");
+    }
+    if (memcmp(magic, "spr2", 4) == 0) {
+        return parse_bank_v2(&in, bank);
+    }
+    if (memcmp(magic, "sprt", 4) == 0) {
+        bank->named = true;
+    } else if (memcmp(magic, "spru", 4) != 0) {
+        return bank_error(bank, "not a sprite file");
+    }
+    return parse_bank_v1(&in, bank);
+}
+
+// not terminated, len is at most MAX_NAME_LEN - 1
+const char *bank_name(const Bank *bank, int i, int *len) {
+    if (bank->name_offsets == NULL) {
+        const char *name =
+            (const char *)bank->names + (size_t)i * bank->name_stride;
+        *len = strnlen(name, MAX_NAME_LEN - 1);
+        return name;
+    }
+    const unsigned char *range = bank->name_offsets + i * sizeof(uint32_t);
+    uint32_t start = load_le32(range);
+    uint32_t stored = load_le32(range + 4) - start;
+    *len = stored < (uint32_t)MAX_NAME_LEN ? (int)stored : MAX_NAME_LEN - 1;
+    return (const char *)bank->names + start;
+}
+
+const unsigned char *bank_pixels(const Bank *bank, int i) {
+    return bank->pixels + (size_t)i * bank->pixel_stride;
+}
+
+int bank_palette(const Bank *bank, int i) {
+    if (bank->palette_indices == NULL ||
+        bank->palette_indices[i] >= bank->palette_count) {
+        return 0;
+    }
+    return bank->palette_indices[i];
+}
+
+bool same_record(const Bank *a, const Bank *b, int i) {
+    if (a->named != b->named || bank_palette(a, i) != bank_palette(b, i)) {
+        return false;
+    }
+    if (a->named) {
+        int a_len, b_len;
+        const char *a_name = bank_name(a, i, &a_len);
+        const char *b_name = bank_name(b, i, &b_len);
+        if (a_len != b_len || memcmp(a_name, b_name, a_len) != 0) {
+            return false;
+        }
+    }
+    return memcmp(bank_pixels(a, i), bank_pixels(b, i), SPRITE_BYTES) == 0;
+}
+
+bool same_palettes(const Bank *a, const Bank *b) {
+    if (a->palette_count != b->palette_count) {
+        return false;
+    }
+    for (int p = 0; p < a->palette_count; p++) {
+        if (memcmp(a->palettes[p], b->palettes[p],
+                   NUM_COLORS * sizeof(Color)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void set_bank_palettes(const Bank *bank) {
+    for (int p = 0; p < bank->palette_count; p++) {
+        memcpy(PALETTES[p], bank->palettes[p], NUM_COLORS * sizeof(Color));
+    }
+    PALETTE_COUNT = bank->palette_count;
+    if (GALLERY_PALETTE >= PALETTE_COUNT) {
+        GALLERY_PALETTE = -1;
+    }
+    // sprites that were there before may point past the palettes now
+    da_foreach(Sprite, s, &SPRITES) {
+        if (s->palette >= PALETTE_COUNT) {
+            s->palette = 0;
+            shm_mark(s - SPRITES.items);
+        }
+    }
+    memcpy(NEW_COLORS, COLORS, NUM_COLORS * sizeof(Color));
+    PALETTE_VERSION++;
+}
+
+char *name_from_bank(const Bank *bank, int i) {
+    if (!bank->named) {
+        char name[16];
+        snprintf(name, sizeof(name), "%d", i);
+        return strdup(name);
+    }
+    int len;
+    const char *stored = bank_name(bank, i, &len);
+    char *name = malloc(len + 1);
+    memcpy(name, stored, len);
+    name[len] = '\0';
+    return name;
+}
+
+// Appends the sprites of a parsed bank and takes over its palettes. Both
+// versions come through here. Bitmaps and names are copied in separate
+// passes, so each streams through one section of a version 2 bank. False if
+// the sprites would not fit next to the ones already loaded.
+bool load_bank(const Bank *bank) {
+    if (bank->count > MAX_SPRITES - SPRITES.count) {
+        TraceLog(LOG_ERROR, "can't load %d more sprites, at most %d fit",
+                 bank->count, MAX_SPRITES);
+        return false;
+    }
+    NAMED = bank->named;
+    set_bank_palettes(bank);
+    int first = SPRITES.count;
+    shm_mark_moved(first);
+    da_reserve(&SPRITES, first + bank->count);
+    for (int i = 0; i < bank->count; i++) {
+        unsigned char *pixels = malloc(SPRITE_BYTES);
+        memcpy(pixels, bank_pixels(bank, i), SPRITE_BYTES);
+        SPRITES.items[SPRITES.count++] = (Sprite){
+            .pixels = pixels,
+            .id = NEXT_SPRITE_ID++,
+            .palette = bank_palette(bank, i),
         };
-        DrawRectangleRec(opaque_r, opaque);
+    }
+    for (int i = 0; i < bank->count; i++) {
+        SPRITES.items[first + i].name = name_from_bank(bank, i);
+    }
+    return true;
+}
 
-        opaque_r.x += opaque_r.width;
-        opaque_r.y += opaque_r.height;
-        DrawRectangleRec(opaque_r, opaque);
+// Loads a bank already in memory, path only names it in messages. Nothing is
+// allocated before parse_bank checked the counts against size.
+int load_buffer(const unsigned char *data, size_t size, const char *path) {
+    Bank bank;
+    if (!parse_bank(data, size, &bank)) {
+        TraceLog(LOG_ERROR, "%s is not a sprite file or is damaged: %s", path,
+                 bank.error);
+        return -1;
+    }
+    TraceLog(LOG_INFO, "reading %s as a version %d %s bank", path,
+             bank.version, bank.named ? "named" : "unnamed");
+    return load_bank(&bank) ? 0 : -1;
+}
+
+int load_file(const char *path) {
+    int result = 0;
+    struct stat st = {0};
+    unsigned char *data = MAP_FAILED;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        result = -1;
+        TraceLog(LOG_ERROR, "Error opening file: %s", path);
+        goto cleanup;
+    }
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            result = -1;
+            TraceLog(LOG_ERROR, "Error reading: %s", path);
+            goto cleanup;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    result = load_buffer(data == MAP_FAILED ? NULL : data, st.st_size, path);
+
+cleanup:
+    if (data != MAP_FAILED) {
+        munmap(data, st.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+typedef struct {
+    char id[4];
+    uint32_t crc;
+    uint64_t offset;
+    uint64_t size;
+} BankSection;
+
+enum { BANK_MAX_SECTIONS = 4 };
+
+// starts the next section at an offset that is a multiple of align
+void section_begin(String_Builder *out, BankSection *section, const char *id,
+                   int align) {
+    while (out->count % align != 0) {
+        da_append(out, 0);
+    }
+    memcpy(section->id, id, 4);
+    section->offset = out->count;
+}
+
+void section_end(String_Builder *out, BankSection *section) {
+    section->size = out->count - section->offset;
+    section->crc = crc32c(0, out->items + section->offset, section->size);
+}
+
+// the zero padded 64 byte name of a version 1 record
+void store_name_slot(unsigned char *slot, const char *name) {
+    size_t len = strnlen(name, MAX_NAME_LEN - 1);
+    memcpy(slot, name, len);
+    memset(slot + len, 0, MAX_NAME_LEN - len);
+}
+
+// Lays the sprites at indices (all if NULL) out as a version 1 bank, for
+// tools that don't read version 2 yet.
+void encode_bank_v1(String_Builder *out, const int *indices, int count) {
+    int record = SPRITE_BYTES + (NAMED ? MAX_NAME_LEN : 0);
+    da_reserve(out, out->count + BANK_HEADER_BYTES + (size_t)count * record);
+    sb_append_buf(out, NAMED ? "sprt" : "spru", 4);
+    append_le32(out, count);
+    sb_append_buf(out, COLORS, NUM_COLORS * sizeof(Color));
+    bool trailer = PALETTE_COUNT > 1;
+    for (int i = 0; i < count; i++) {
+        const Sprite *sprite = &SPRITES.items[indices ? indices[i] : i];
+        unsigned char *at = (unsigned char *)out->items + out->count;
+        if (NAMED) {
+            store_name_slot(at, sprite->name);
+            at += MAX_NAME_LEN;
+        }
+        memcpy(at, sprite->pixels, SPRITE_BYTES);
+        out->count += record;
+        trailer |= sprite->palette != 0;
+    }
+    if (!trailer) {
+        return;
+    }
+    sb_append_buf(out, "spal", 4);
+    append_le32(out, PALETTE_TRAILER_VERSION);
+    append_le32(out, PALETTE_COUNT);
+    sb_append_buf(out, PALETTES[1],
+                  (PALETTE_COUNT - 1) * sizeof(PALETTES[0]));
+    for (int i = 0; i < count; i++) {
+        da_append(out, SPRITES.items[indices ? indices[i] : i].palette);
+    }
+}
+
+// Lays the sprites at indices (all if NULL) out as a version 2 bank.
+void encode_bank_v2(String_Builder *out, const int *indices, int count) {
+    bool palettes = false;
+    for (int i = 0; i < count && !palettes; i++) {
+        palettes = SPRITES.items[indices ? indices[i] : i].palette != 0;
+    }
+    BankSection sections[BANK_MAX_SECTIONS] = {0};
+    int section_count = 2 + palettes + NAMED;
+    size_t table_end =
+        BANK_V2_HEADER_BYTES + section_count * BANK_SECTION_BYTES;
+    da_reserve(out, table_end + PALETTE_COUNT * sizeof(PALETTES[0]) +
+                        (size_t)count * (SPRITE_BYTES + MAX_NAME_LEN + 5) +
+                        section_count * BANK_SECTION_ALIGN +
+                        BANK_BITMAP_ALIGN);
+    memset(out->items, 0, table_end);
+    out->count = table_end;
+
+    BankSection *section = sections;
+    section_begin(out, section, "PALS", BANK_SECTION_ALIGN);
+    sb_append_buf(out, PALETTES, PALETTE_COUNT * sizeof(PALETTES[0]));
+    section_end(out, section++);
+    if (palettes) {
+        section_begin(out, section, "SPAL", BANK_SECTION_ALIGN);
+        for (int i = 0; i < count; i++) {
+            da_append(out, SPRITES.items[indices ? indices[i] : i].palette);
+        }
+        section_end(out, section++);
+    }
+    if (NAMED) {
+        section_begin(out, section, "NAME", BANK_SECTION_ALIGN);
+        size_t table = out->count;
+        size_t names = table + ((size_t)count + 1) * sizeof(uint32_t);
+        da_reserve(out, names);
+        out->count = names;
+        for (int i = 0; i <= count; i++) {
+            store_le32((unsigned char *)out->items + table +
+                           i * sizeof(uint32_t),
+                       out->count - names);
+            if (i < count) {
+                const char *name =
+                    SPRITES.items[indices ? indices[i] : i].name;
+                sb_append_buf(out, name, strnlen(name, MAX_NAME_LEN - 1));
+            }
+        }
+        section_end(out, section++);
+    }
+    size_t bitmaps = (size_t)count * SPRITE_BYTES;
+    section_begin(out, section, "BMAP",
+                  bitmaps < BANK_BITMAP_ALIGN_MIN ? BANK_SECTION_ALIGN
+                                                  : BANK_BITMAP_ALIGN);
+    for (int i = 0; i < count; i++) {
+        sb_append_buf(out, SPRITES.items[indices ? indices[i] : i].pixels,
+                      SPRITE_BYTES);
+    }
+    section_end(out, section++);
+
+    String_Builder header = {0};
+    sb_append_buf(&header, "spr2", 4);
+    append_le32(&header, BANK_V2_VERSION);
+    append_le32(&header, NAMED ? BANK_NAMED : 0);
+    append_le32(&header, count);
+    append_le32(&header, section_count);
+    append_le32(&header, 0);
+    for (int s = 0; s < section_count; s++) {
+        sb_append_buf(&header, sections[s].id, 4);
+        append_le32(&header, sections[s].crc);
+        append_le64(&header, sections[s].offset);
+        append_le64(&header, sections[s].size);
+    }
+    uint32_t crc = crc32c(crc32c(0, header.items, 20),
+                          header.items + BANK_V2_HEADER_BYTES,
+                          section_count * BANK_SECTION_BYTES);
+    store_le32((unsigned char *)header.items + 20, crc);
+    memcpy(out->items, header.items, table_end);
+    sb_free(header);
+}
+
+void free_sprite(Sprite *sprite) {
+    free(sprite->name);
+    free(sprite->pixels);
+    da_free(sprite->layers);
+}
+
+// deep copy, including id and version
+Sprite clone_sprite(const Sprite *sprite) {
+    Sprite copy = *sprite;
+    copy.name = strdup(sprite->name);
+    copy.pixels = malloc(SPRITE_BYTES);
+    if (copy.name == NULL || copy.pixels == NULL) {
+        TraceLog(LOG_FATAL, "could not copy sprite");
+        abort();
+    }
+    memcpy(copy.pixels, sprite->pixels, SPRITE_BYTES);
+    copy.layers = (LayerList){0};
+    if (sprite->layers.count > 0) {
+        da_append_many(&copy.layers, sprite->layers.items,
+                       sprite->layers.count);
+    }
+    return copy;
+}
+
+void free_sprite_list(SpriteList *list) {
+    da_foreach(Sprite, s, list) { free_sprite(s); }
+    da_free(*list);
+    *list = (SpriteList){0};
+}
+
+void unload_sprites() { free_sprite_list(&SPRITES); }
+
+// writes the sprites at indices, or all sprites if indices is NULL
+int write_sprites(const char *path, const int *indices, int index_count) {
+    int count = indices ? index_count : SPRITES.count;
+    String_Builder out = {0};
+    if (SAVE_VERSION == 1) {
+        encode_bank_v1(&out, indices, count);
+    } else {
+        encode_bank_v2(&out, indices, count);
+    }
+    int result = write_entire_file(path, out.items, out.count) ? 0 : -1;
+    sb_free(out);
+    return result;
+}
+
+int write_file(const char *path) { return write_sprites(path, NULL, 0); }
+
+#ifdef SPREDIT_FUZZ
+// Entry point for libFuzzer and AFL++, built by `./nob fuzz`. Whatever loads
+// has to come back the same after saving it again.
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    SetTraceLogLevel(LOG_NONE);
+    if (load_buffer(data, size, "input") == 0) {
+        String_Builder out = {0};
+        encode_bank_v2(&out, NULL, SPRITES.count);
+        Bank bank;
+        if (!parse_bank((unsigned char *)out.items, out.count, &bank) ||
+            bank.count != SPRITES.count) {
+            abort();
+        }
+        for (int i = 0; i < bank.count; i++) {
+            if (memcmp(bank_pixels(&bank, i), SPRITES.items[i].pixels,
+                       SPRITE_BYTES) != 0 ||
+                bank_palette(&bank, i) != SPRITES.items[i].palette) {
+                abort();
+            }
+        }
+        sb_free(out);
+    }
+    unload_sprites();
+    return 0;
+}
+#endif
+
+static_assert(SPREDIT_SHM_HEADER_BYTES == 8 + NUM_COLORS * sizeof(Color));
+static_assert((int)SPREDIT_SHM_PIXEL_BYTES == (int)SPRITE_BYTES);
+static_assert((int)SPREDIT_SHM_MAX_PALETTES == (int)MAX_PALETTES);
+
+void shm_close() {
+    if (SHM.shm) {
+        atomic_store(&SHM.shm->retired, 1);
+        munmap(SHM.shm, SHM.size);
+    }
+    da_free(SHM.dirty);
+    // a new segment gets every record
+    SHM = (ShmPublisher){.name = SHM.name};
+}
+
+// A new object replaces the old one under the same name, readers still
+// holding the old one see it retired.
+bool shm_create(int capacity) {
+    shm_close();
+    size_t palettes_offset = sizeof(SpreditShm) + SPREDIT_SHM_HEADER_BYTES +
+                             (size_t)capacity * SPREDIT_SHM_RECORD_BYTES;
+    size_t sprite_palettes_offset =
+        palettes_offset + SPREDIT_SHM_PALETTES_BYTES;
+    size_t seq_offset = sprite_palettes_offset + capacity;
+    seq_offset = (seq_offset + 63) & ~(size_t)63;
+    size_t size = seq_offset + capacity * sizeof(uint32_t);
+
+    shm_unlink(SHM.name);
+    int fd = shm_open(SHM.name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        TraceLog(LOG_ERROR, "could not create shared memory %s", SHM.name);
+        return false;
+    }
+    void *memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        memory =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        TraceLog(LOG_ERROR, "could not map shared memory %s", SHM.name);
+        shm_unlink(SHM.name);
+        return false;
+    }
+
+    SHM.shm = memory;
+    SHM.size = size;
+    // a fresh mapping is zeroed, so every sequence counter starts at 0
+    memcpy(SHM.shm->magic, SPREDIT_SHM_MAGIC, sizeof(SHM.shm->magic));
+    SHM.shm->capacity = capacity;
+    SHM.shm->image_offset = sizeof(SpreditShm);
+    SHM.shm->palettes_offset = palettes_offset;
+    SHM.shm->sprite_palettes_offset = sprite_palettes_offset;
+    SHM.shm->seq_offset = seq_offset;
+    memcpy(spredit_shm_image(SHM.shm), "sprt", 4);
+    return true;
+}
+
+void shm_write_begin(_Atomic uint32_t *seq) {
+    uint32_t value = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, value + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void shm_write_end(_Atomic uint32_t *seq) {
+    uint32_t value = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, value + 1, memory_order_release);
+}
+
+void shm_write_record(int index) {
+    const Sprite *sprite = &SPRITES.items[index];
+    unsigned char *record = spredit_shm_record(SHM.shm, index);
+    _Atomic uint32_t *seq = &spredit_shm_seqs(SHM.shm)[index];
+    shm_write_begin(seq);
+    store_name_slot(record, sprite->name);
+    memcpy(record + MAX_NAME_LEN, sprite->pixels, SPRITE_BYTES);
+    spredit_shm_sprite_palettes(SHM.shm)[index] = sprite->palette;
+    shm_write_end(seq);
+}
+
+void shm_publish() {
+    if (SHM.name == NULL) {
+        return;
+    }
+    if (SHM.shm == NULL || (uint32_t)SPRITES.count > SHM.shm->capacity) {
+        int capacity = SPRITES.count * 2 > 1024 ? SPRITES.count * 2 : 1024;
+        if (!shm_create(capacity)) {
+            // don't try again every frame
+            SHM.name = NULL;
+            return;
+        }
+    }
+
+    unsigned char *header = spredit_shm_image(SHM.shm);
+    unsigned char *palettes = spredit_shm_palettes(SHM.shm);
+    size_t palette_bytes = PALETTE_COUNT * sizeof(PALETTES[0]);
+    if (load_le32(header + 4) != (uint32_t)SPRITES.count ||
+        load_le32(palettes) != (uint32_t)PALETTE_COUNT ||
+        memcmp(palettes + 4, PALETTES, palette_bytes) != 0) {
+        shm_write_begin(&SHM.shm->header_seq);
+        store_le32(header + 4, SPRITES.count);
+        memcpy(header + 8, COLORS, NUM_COLORS * sizeof(Color));
+        store_le32(palettes, PALETTE_COUNT);
+        memcpy(palettes + 4, PALETTES, palette_bytes);
+        shm_write_end(&SHM.shm->header_seq);
+    }
+
+    da_foreach(int, index, &SHM.dirty) {
+        // the moved records below cover the rest
+        if (*index < SHM.moved_from && *index < SPRITES.count) {
+            shm_write_record(*index);
+        }
+    }
+    for (int i = SHM.moved_from; i < SPRITES.count; i++) {
+        shm_write_record(i);
+    }
+    SHM.dirty.count = 0;
+    SHM.moved_from = INT_MAX;
+}
+
+void shm_unpublish() {
+    if (SHM.shm) {
+        shm_close();
+        shm_unlink(SHM.name);
+    }
+}
+
+// Software rendering: sprites are rasterized into one CPU image per screen
+// area, which is uploaded and drawn as a single texture. Under software GL
+// such as llvmpipe every rectangle and quad is expensive, while filling
+// memory is cheap. F9 switches between this and the GPU path.
+bool SOFTWARE_RENDER = false;
+
+typedef struct {
+    Color *pixels;
+    // screen area the image covers, in whole pixels
+    int x;
+    int y;
+    int width;
+    int height;
+    Texture2D texture;
+} Framebuffer;
+
+Framebuffer FRAMEBUFFER = {0};
+
+void framebuffer_begin(Rectangle rect) {
+    Framebuffer *fb = &FRAMEBUFFER;
+    int width = rect.width > 0 ? rect.width : 0;
+    int height = rect.height > 0 ? rect.height : 0;
+    if (width != fb->width || height != fb->height) {
+        if (fb->texture.id != 0) {
+            UnloadTexture(fb->texture);
+            fb->texture = (Texture2D){0};
+        }
+        free(fb->pixels);
+        fb->pixels = malloc((size_t)width * height * sizeof(Color));
+        fb->width = width;
+        fb->height = height;
+        if (width > 0 && height > 0) {
+            Image image = {
+                .data = fb->pixels,
+                .width = width,
+                .height = height,
+                .mipmaps = 1,
+                .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+            };
+            fb->texture = LoadTextureFromImage(image);
+        }
+    }
+    fb->x = rect.x;
+    fb->y = rect.y;
+    memset(fb->pixels, 0, (size_t)width * height * sizeof(Color));
+}
+
+// Draws a sprite scaled to size x size pixels at screen position left, top,
+// clipped to the framebuffer.
+void framebuffer_sprite(const unsigned char *sprite, const Color *colors,
+                        int left, int top, int size, bool skip_transparent) {
+    Framebuffer *fb = &FRAMEBUFFER;
+    left -= fb->x;
+    top -= fb->y;
+    // the framebuffer columns each sprite column covers
+    int starts[SPRITE_SIZE + 1];
+    for (int sx = 0; sx <= SPRITE_SIZE; sx++) {
+        int x = left + sx * size / SPRITE_SIZE;
+        starts[sx] = x < 0 ? 0 : x > fb->width ? fb->width : x;
+    }
+    int first = top < 0 ? 0 : top;
+    int last = top + size < fb->height ? top + size : fb->height;
+    int previous = -1;
+    for (int y = first; y < last; y++) {
+        int sy = (y - top) * SPRITE_SIZE / size;
+        Color *line = fb->pixels + (size_t)y * fb->width;
+        // rows of one sprite row are the same
+        if (sy == previous && !skip_transparent) {
+            memcpy(line + starts[0], line - fb->width + starts[0],
+                   (starts[SPRITE_SIZE] - starts[0]) * sizeof(Color));
+            continue;
+        }
+        previous = sy;
+        uint64_t row = load_row(sprite + sy * ROW_BYTES);
+        for (int sx = 0; sx < SPRITE_SIZE; sx++, row >>= 4) {
+            int index = row & 0xF;
+            if (skip_transparent && index == TRANSPARENT_INDEX) {
+                continue;
+            }
+            Color color = colors[index];
+            for (int x = starts[sx]; x < starts[sx + 1]; x++) {
+                line[x] = color;
+            }
+        }
+    }
+}
+
+void framebuffer_end() {
+    Framebuffer *fb = &FRAMEBUFFER;
+    if (fb->texture.id == 0) {
+        return;
+    }
+    UpdateTexture(fb->texture, fb->pixels);
+    DrawTexture(fb->texture, fb->x, fb->y, WHITE);
+}
+
+void framebuffer_unload() {
+    if (FRAMEBUFFER.texture.id != 0) {
+        UnloadTexture(FRAMEBUFFER.texture);
+    }
+    free(FRAMEBUFFER.pixels);
+    FRAMEBUFFER = (Framebuffer){0};
+}
+
+void software_render_shortcut() {
+    if (IsKeyPressed(KEY_F9)) {
+        SOFTWARE_RENDER = !SOFTWARE_RENDER;
+    }
+}
+
+void draw_sprite(unsigned char *sprite, int pixel_width, int left, int top,
+                 bool skip_transparent) {
+    if (sprite == NULL) {
+        return;
+    }
+    if (SOFTWARE_RENDER) {
+        int size = SPRITE_SIZE * pixel_width;
+        framebuffer_begin((Rectangle){left, top, size, size});
+        framebuffer_sprite(sprite, DISPLAYCOLORS, left, top, size,
+                           skip_transparent);
+        framebuffer_end();
+        return;
+    }
+    for (int i = 0; i < SPRITE_SIZE * SPRITE_SIZE; i++) {
+        int idx = i / 2;
+        int color_idx;
+        if (i % 2 == 0) {
+            color_idx = sprite[idx] & 0x0F;
+        } else {
+            color_idx = sprite[idx] >> 4 & 0x0F;
+        }
+        if (skip_transparent && color_idx == TRANSPARENT_INDEX) {
+            continue;
+        }
+        int x = i % 16;
+        int y = i / 16;
+        DrawRectangle(left + x * pixel_width, top + y * pixel_width,
+                      pixel_width, pixel_width, DISPLAYCOLORS[color_idx]);
+    }
+}
+
+// Both colors of every possible byte, so decoding is one 8 byte copy per
+// byte of the sprite.
+typedef Color PairLut[256][2];
+
+void build_pair_lut(const Color *palette, PairLut lut) {
+    for (int byte = 0; byte < 256; byte++) {
+        lut[byte][0] = palette[byte & 0x0F];
+        lut[byte][1] = palette[byte >> 4 & 0x0F];
+    }
+}
+
+void decode_sprite(const unsigned char *sprite, PairLut lut, Color *out) {
+    for (int i = 0; i < SPRITE_BYTES; i++) {
+        memcpy(&out[2 * i], lut[sprite[i]], 2 * sizeof(Color));
+    }
+}
+
+// luts of PALETTES for decoding on the main thread
+PairLut DISPLAY_LUTS[MAX_PALETTES] = {0};
+unsigned int DISPLAY_LUT_VERSIONS[MAX_PALETTES] = {0};
+
+PairLut *display_lut(int palette) {
+    if (DISPLAY_LUT_VERSIONS[palette] != PALETTE_VERSION) {
+        build_pair_lut(PALETTES[palette], DISPLAY_LUTS[palette]);
+        DISPLAY_LUT_VERSIONS[palette] = PALETTE_VERSION;
+    }
+    return &DISPLAY_LUTS[palette];
+}
+
+// Box filters a decoded sprite in place down to SPRITE_SIZE >> level pixels
+// per side.
+void downsample(Color *rgba, int level) {
+    for (int l = 1; l <= level; l++) {
+        int size = SPRITE_SIZE >> l;
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                Color *a = &rgba[(2 * y) * 2 * size + 2 * x];
+                Color *b = a + 2 * size;
+                rgba[y * size + x] = (Color){
+                    (a[0].r + a[1].r + b[0].r + b[1].r + 2) / 4,
+                    (a[0].g + a[1].g + b[0].g + b[1].g + 2) / 4,
+                    (a[0].b + a[1].b + b[0].b + b[1].b + 2) / 4,
+                    (a[0].a + a[1].a + b[0].a + b[1].a + 2) / 4,
+                };
+            }
+        }
+    }
+}
+
+// Decoded sprites live in slots of big textures, so drawing a sprite that did
+// not change is a single textured quad and a screen full of sprites is a
+// single batch. Level l holds sprites downsampled to 16 >> l pixels, for
+// when the gallery is zoomed out. Slots are keyed by sprite and palette, so
+// variants of a sprite each have their own. A slot is decoded again when the
+// sprite or the palettes changed, and the least recently drawn slot is the
+// one that gets handed out next.
+const int ATLAS_TEXTURE_SIZE[ATLAS_LEVELS] = {2048, 2048, 1024, 512};
+// slot 0 of every level is never handed out and shows PLACEHOLDER_COLOR
+enum { PLACEHOLDER_SLOT = 0 };
+
+typedef struct {
+    unsigned int owner;
+    int palette;
+    // the version and PALETTE_VERSION that is uploaded or being decoded,
+    // palette_version 0 means nothing was requested yet
+    unsigned int version;
+    unsigned int palette_version;
+    unsigned int last_used;
+    // neighbours in the list from least to most recently used, which is
+    // closed through PLACEHOLDER_SLOT
+    int older;
+    int newer;
+    // holds some image of owner, possibly an older version
+    bool ready;
+} AtlasSlot;
+
+typedef struct {
+    Texture2D texture;
+    // size of a slot in pixels
+    int cell;
+    // slots per row
+    int columns;
+    int slot_count;
+    AtlasSlot *slots;
+    // open addressing from owner and palette to slot, -1 for empty entries
+    int *lookup;
+    int lookup_mask;
+} SpriteAtlas;
+
+SpriteAtlas ATLAS[ATLAS_LEVELS] = {0};
+unsigned int ATLAS_FRAME = 0;
+
+Rectangle atlas_slot_rect(int level, int slot) {
+    SpriteAtlas *atlas = &ATLAS[level];
+    return (Rectangle){
+        .x = (slot % atlas->columns) * atlas->cell,
+        .y = (slot / atlas->columns) * atlas->cell,
+        .width = atlas->cell,
+        .height = atlas->cell,
+    };
+}
+
+// Thumbnails are decoded by a fixed pool of workers. Jobs carry a copy of the
+// pixels and palette, so workers never touch SPRITES. Every worker hands its
+// results back through its own single producer single consumer ring, which
+// the main thread drains and uploads into the atlas.
+enum { MAX_THUMB_WORKERS = 8 };
+enum { THUMB_JOB_LEN = 4096 };
+enum { THUMB_RESULT_LEN = 256 };
+// uploads per frame, so a flood of results can't stall a frame
+enum { THUMB_UPLOAD_BUDGET = 1024 };
+
+typedef struct {
+    unsigned int owner;
+    int palette;
+    unsigned int version;
+    unsigned int palette_version;
+    int level;
+    int slot;
+} ThumbKey;
+
+typedef struct {
+    ThumbKey key;
+    unsigned char pixels[SPRITE_BYTES];
+    Color colors[NUM_COLORS];
+} ThumbJob;
+
+typedef struct {
+    ThumbKey key;
+    Color rgba[SPRITE_SIZE * SPRITE_SIZE];
+} ThumbResult;
+
+typedef struct {
+    ThumbResult items[THUMB_RESULT_LEN];
+    // head is only written by the main thread, tail only by the worker
+    _Atomic size_t head;
+    _Atomic size_t tail;
+} ThumbRing;
+
+typedef struct {
+    ThumbJob items[THUMB_JOB_LEN];
+    int head;
+    int count;
+} ThumbQueue;
+
+typedef struct {
+    pthread_t threads[MAX_THUMB_WORKERS];
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // signaled after thumb_upload_results made room in the rings
+    pthread_cond_t drained;
+    // sprites on screen, always served first
+    ThumbQueue visible;
+    // speculative work, can be thrown away when the user jumps elsewhere
+    ThumbQueue prefetch;
+    atomic_bool quit;
+    ThumbRing rings[MAX_THUMB_WORKERS];
+} ThumbPool;
+
+ThumbPool THUMBS = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+bool thumb_ring_push(ThumbRing *ring, const ThumbResult *result) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == THUMB_RESULT_LEN) {
+        return false;
+    }
+    ring->items[tail % THUMB_RESULT_LEN] = *result;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+ThumbResult *thumb_ring_peek(ThumbRing *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->items[head % THUMB_RESULT_LEN];
+}
+
+void thumb_ring_pop(ThumbRing *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+size_t thumb_ring_len(ThumbRing *ring) {
+    return atomic_load(&ring->tail) - atomic_load(&ring->head);
+}
+
+void *thumb_worker(void *arg) {
+    ThumbRing *ring = arg;
+    // one per palette, so jobs for different palettes can interleave
+    PairLut *luts = malloc(MAX_PALETTES * sizeof(PairLut));
+    Color lut_colors[MAX_PALETTES][NUM_COLORS];
+    bool lut_valid[MAX_PALETTES] = {0};
+    ThumbResult result;
+
+    pthread_mutex_lock(&THUMBS.lock);
+    while (!THUMBS.quit) {
+        ThumbQueue *queue = &THUMBS.visible;
+        if (queue->count == 0) {
+            queue = &THUMBS.prefetch;
+        }
+        if (queue->count == 0) {
+            pthread_cond_wait(&THUMBS.wake, &THUMBS.lock);
+            continue;
+        }
+        ThumbJob job = queue->items[queue->head];
+        queue->head = (queue->head + 1) % THUMB_JOB_LEN;
+        queue->count--;
+        pthread_mutex_unlock(&THUMBS.lock);
+
+        int palette = job.key.palette;
+        if (!lut_valid[palette] ||
+            memcmp(lut_colors[palette], job.colors, sizeof(job.colors))) {
+            memcpy(lut_colors[palette], job.colors, sizeof(job.colors));
+            build_pair_lut(job.colors, luts[palette]);
+            lut_valid[palette] = true;
+        }
+        result.key = job.key;
+        decode_sprite(job.pixels, luts[palette], result.rgba);
+        downsample(result.rgba, job.key.level);
+
+        pthread_mutex_lock(&THUMBS.lock);
+        // a full ring waits for the main thread to upload
+        while (!thumb_ring_push(ring, &result) && !THUMBS.quit) {
+            pthread_cond_wait(&THUMBS.drained, &THUMBS.lock);
+        }
+    }
+    pthread_mutex_unlock(&THUMBS.lock);
+    free(luts);
+    return NULL;
+}
+
+void thumb_pool_start() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    // leave a core for the render thread
+    int count = cores > 2 ? cores - 1 : 1;
+    if (count > MAX_THUMB_WORKERS) {
+        count = MAX_THUMB_WORKERS;
+    }
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&THUMBS.threads[i], NULL, thumb_worker,
+                           &THUMBS.rings[i]) != 0) {
+            TraceLog(LOG_WARNING, "could only start %d thumbnail workers", i);
+            break;
+        }
+        THUMBS.worker_count++;
+    }
+}
+
+void thumb_pool_stop() {
+    pthread_mutex_lock(&THUMBS.lock);
+    THUMBS.quit = true;
+    pthread_cond_broadcast(&THUMBS.wake);
+    pthread_cond_broadcast(&THUMBS.drained);
+    pthread_mutex_unlock(&THUMBS.lock);
+    for (int i = 0; i < THUMBS.worker_count; i++) {
+        pthread_join(THUMBS.threads[i], NULL);
+    }
+    THUMBS.worker_count = 0;
+}
+
+bool thumb_enqueue(const Sprite *sprite, int palette, int level,
+                   bool prefetch) {
+    if (THUMBS.worker_count == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&THUMBS.lock);
+    ThumbQueue *queue = prefetch ? &THUMBS.prefetch : &THUMBS.visible;
+    bool queued = queue->count < THUMB_JOB_LEN;
+    if (queued) {
+        ThumbJob *job =
+            &queue->items[(queue->head + queue->count) % THUMB_JOB_LEN];
+        job->key = (ThumbKey){
+            .owner = sprite->id,
+            .palette = palette,
+            .version = sprite->version,
+            .palette_version = PALETTE_VERSION,
+            .level = level,
+            .slot = sprite->slots[level],
+        };
+        memcpy(job->pixels, sprite->pixels, SPRITE_BYTES);
+        memcpy(job->colors, PALETTES[palette], sizeof(job->colors));
+        queue->count++;
+        pthread_cond_signal(&THUMBS.wake);
+    }
+    pthread_mutex_unlock(&THUMBS.lock);
+    return queued;
+}
+
+// jobs waiting for a worker plus results waiting for upload
+int thumb_queue_depth() {
+    pthread_mutex_lock(&THUMBS.lock);
+    int depth = THUMBS.visible.count + THUMBS.prefetch.count;
+    pthread_mutex_unlock(&THUMBS.lock);
+    for (int i = 0; i < THUMBS.worker_count; i++) {
+        depth += thumb_ring_len(&THUMBS.rings[i]);
+    }
+    return depth;
+}
+
+bool thumb_key_matches(const AtlasSlot *entry, ThumbKey key) {
+    return entry->owner == key.owner && entry->palette == key.palette &&
+           entry->version == key.version &&
+           entry->palette_version == key.palette_version;
+}
+
+// Drops all queued prefetch jobs. Their slots are marked as not requested,
+// so they get queued again once they are needed.
+void thumb_cancel_prefetch() {
+    pthread_mutex_lock(&THUMBS.lock);
+    ThumbQueue *queue = &THUMBS.prefetch;
+    for (int i = 0; i < queue->count; i++) {
+        ThumbKey key = queue->items[(queue->head + i) % THUMB_JOB_LEN].key;
+        AtlasSlot *entry = &ATLAS[key.level].slots[key.slot];
+        if (thumb_key_matches(entry, key)) {
+            entry->palette_version = 0;
+        }
+    }
+    queue->count = 0;
+    pthread_mutex_unlock(&THUMBS.lock);
+}
+
+void thumb_upload_results() {
+    int budget = THUMB_UPLOAD_BUDGET;
+    bool popped = false;
+    for (int i = 0; i < THUMBS.worker_count; i++) {
+        ThumbRing *ring = &THUMBS.rings[i];
+        ThumbResult *result;
+        while (budget > 0 && (result = thumb_ring_peek(ring))) {
+            ThumbKey key = result->key;
+            AtlasSlot *entry = &ATLAS[key.level].slots[key.slot];
+            // drop results for slots that were reassigned or re-requested
+            if (thumb_key_matches(entry, key)) {
+                UpdateTextureRec(ATLAS[key.level].texture,
+                                 atlas_slot_rect(key.level, key.slot),
+                                 result->rgba);
+                entry->ready = true;
+                budget--;
+            }
+            thumb_ring_pop(ring);
+            popped = true;
+        }
+    }
+    if (popped) {
+        pthread_mutex_lock(&THUMBS.lock);
+        pthread_cond_broadcast(&THUMBS.drained);
+        pthread_mutex_unlock(&THUMBS.lock);
+    }
+}
+
+// call once per frame, slots used in the current frame are never evicted
+void atlas_begin_frame() {
+    for (int level = 0; level < ATLAS_LEVELS; level++) {
+        SpriteAtlas *atlas = &ATLAS[level];
+        if (atlas->slots) {
+            continue;
+        }
+        int size = ATLAS_TEXTURE_SIZE[level];
+        atlas->cell = SPRITE_SIZE >> level;
+        atlas->columns = size / atlas->cell;
+        atlas->slot_count = atlas->columns * atlas->columns;
+        atlas->slots = calloc(atlas->slot_count, sizeof(AtlasSlot));
+        // every slot but the placeholder starts out in the list
+        for (int slot = 0; slot < atlas->slot_count; slot++) {
+            atlas->slots[slot].older =
+                (slot + atlas->slot_count - 1) % atlas->slot_count;
+            atlas->slots[slot].newer = (slot + 1) % atlas->slot_count;
+        }
+        int lookup_size = 1;
+        while (lookup_size < 2 * atlas->slot_count) {
+            lookup_size *= 2;
+        }
+        atlas->lookup = malloc(lookup_size * sizeof(int));
+        memset(atlas->lookup, -1, lookup_size * sizeof(int));
+        atlas->lookup_mask = lookup_size - 1;
+        Image blank = GenImageColor(size, size, BLANK);
+        atlas->texture = LoadTextureFromImage(blank);
+        UnloadImage(blank);
+        Image placeholder =
+            GenImageColor(atlas->cell, atlas->cell, PLACEHOLDER_COLOR);
+        UpdateTextureRec(atlas->texture,
+                         atlas_slot_rect(level, PLACEHOLDER_SLOT),
+                         placeholder.data);
+        UnloadImage(placeholder);
+    }
+    ATLAS_FRAME++;
+    thumb_upload_results();
+}
+
+void atlas_unload() {
+    for (int level = 0; level < ATLAS_LEVELS; level++) {
+        if (ATLAS[level].texture.id != 0) {
+            UnloadTexture(ATLAS[level].texture);
+        }
+        free(ATLAS[level].slots);
+        free(ATLAS[level].lookup);
+        ATLAS[level] = (SpriteAtlas){0};
+    }
+}
+
+uint32_t atlas_hash(const SpriteAtlas *atlas, unsigned owner, int palette) {
+    return (owner * MAX_PALETTES + palette) * 0x9E3779B1u & atlas->lookup_mask;
+}
+
+// position of the lookup entry for owner and palette, or of the empty entry
+// it would go into
+int atlas_lookup(const SpriteAtlas *atlas, unsigned owner, int palette) {
+    int i = atlas_hash(atlas, owner, palette);
+    while (atlas->lookup[i] >= 0) {
+        const AtlasSlot *entry = &atlas->slots[atlas->lookup[i]];
+        if (entry->owner == owner && entry->palette == palette) {
+            break;
+        }
+        i = (i + 1) & atlas->lookup_mask;
+    }
+    return i;
+}
+
+// Removes the lookup entry of a slot and moves later entries of the same
+// probe run back into the gap, so lookups never need tombstones.
+void atlas_forget(SpriteAtlas *atlas, int slot) {
+    const AtlasSlot *entry = &atlas->slots[slot];
+    int gap = atlas_lookup(atlas, entry->owner, entry->palette);
+    if (atlas->lookup[gap] != slot) {
+        return;
+    }
+    for (int i = (gap + 1) & atlas->lookup_mask; atlas->lookup[i] >= 0;
+         i = (i + 1) & atlas->lookup_mask) {
+        const AtlasSlot *moved = &atlas->slots[atlas->lookup[i]];
+        int home = atlas_hash(atlas, moved->owner, moved->palette);
+        // entries whose home lies between the gap and i have to stay
+        if (((i - home) & atlas->lookup_mask) >=
+            ((i - gap) & atlas->lookup_mask)) {
+            atlas->lookup[gap] = atlas->lookup[i];
+            gap = i;
+        }
+    }
+    atlas->lookup[gap] = -1;
+}
+
+// moves slot to the most recently used end of the list
+void atlas_touch(SpriteAtlas *atlas, int slot) {
+    AtlasSlot *slots = atlas->slots;
+    slots[slots[slot].older].newer = slots[slot].newer;
+    slots[slots[slot].newer].older = slots[slot].older;
+    int newest = slots[PLACEHOLDER_SLOT].older;
+    slots[slot].older = newest;
+    slots[slot].newer = PLACEHOLDER_SLOT;
+    slots[newest].newer = slot;
+    slots[PLACEHOLDER_SLOT].older = slot;
+}
+
+// the least recently used slot, unless even that one is on screen
+int atlas_find(SpriteAtlas *atlas) {
+    int slot = atlas->slots[PLACEHOLDER_SLOT].newer;
+    if (slot == PLACEHOLDER_SLOT ||
+        atlas->slots[slot].last_used == ATLAS_FRAME) {
+        return -1;
+    }
+    return slot;
+}
+
+// makes sure sprite owns a slot for palette, returns NULL if the atlas is
+// full
+AtlasSlot *atlas_claim(Sprite *sprite, int palette, int level) {
+    SpriteAtlas *atlas = &ATLAS[level];
+    AtlasSlot *entry = &atlas->slots[sprite->slots[level]];
+    if (entry->owner == sprite->id && entry->palette == palette) {
+        return entry;
+    }
+    int found = atlas->lookup[atlas_lookup(atlas, sprite->id, palette)];
+    if (found >= 0) {
+        sprite->slots[level] = found;
+        return &atlas->slots[found];
+    }
+    int slot = atlas_find(atlas);
+    if (slot < 0) {
+        return NULL;
+    }
+    entry = &atlas->slots[slot];
+    if (entry->owner != 0) {
+        atlas_forget(atlas, slot);
+    }
+    *entry = (AtlasSlot){
+        .owner = sprite->id,
+        .palette = palette,
+        .older = entry->older,
+        .newer = entry->newer,
+    };
+    atlas->lookup[atlas_lookup(atlas, sprite->id, palette)] = slot;
+    // new slots count as used, or prefetching would evict its own work
+    atlas_touch(atlas, slot);
+    sprite->slots[level] = slot;
+    return entry;
+}
+
+bool atlas_stale(AtlasSlot *entry, Sprite *sprite) {
+    return entry->palette_version != PALETTE_VERSION ||
+           entry->version != sprite->version;
+}
+
+bool atlas_ready(Sprite *sprite, int palette, int level) {
+    AtlasSlot *entry = &ATLAS[level].slots[sprite->slots[level]];
+    return entry->owner == sprite->id && entry->palette == palette &&
+           entry->ready;
+}
+
+// decodes the sprite on this thread into the slot it owns
+void atlas_upload(Sprite *sprite, int palette, int level) {
+    AtlasSlot *entry = &ATLAS[level].slots[sprite->slots[level]];
+    Color rgba[SPRITE_SIZE * SPRITE_SIZE];
+    decode_sprite(sprite->pixels, *display_lut(palette), rgba);
+    downsample(rgba, level);
+    UpdateTextureRec(ATLAS[level].texture,
+                     atlas_slot_rect(level, sprite->slots[level]), rgba);
+    entry->version = sprite->version;
+    entry->palette_version = PALETTE_VERSION;
+    entry->ready = true;
+}
+
+void atlas_use(int level, AtlasSlot *entry) {
+    SpriteAtlas *atlas = &ATLAS[level];
+    if (entry->last_used != ATLAS_FRAME) {
+        entry->last_used = ATLAS_FRAME;
+        atlas_touch(atlas, entry - atlas->slots);
+    }
+}
+
+// returns the full size source rectangle of the sprite in ATLAS[0], decoding
+// it right away if needed
+Rectangle atlas_sprite(Sprite *sprite) {
+    AtlasSlot *entry = atlas_claim(sprite, sprite->palette, 0);
+    if (entry == NULL) {
+        return (Rectangle){0};
+    }
+    if (atlas_stale(entry, sprite) || !entry->ready) {
+        atlas_upload(sprite, sprite->palette, 0);
+    }
+    atlas_use(0, entry);
+    return atlas_slot_rect(0, sprite->slots[0]);
+}
+
+// Like atlas_sprite, but for any level and palette, and decoding happens on
+// the thumbnail workers. Until there is something to show, rect is the
+// placeholder. A sprite that changed keeps showing its old image until the
+// new one arrives.
+bool atlas_request(Sprite *sprite, int palette, int level, Rectangle *rect,
+                   bool visible) {
+    *rect = atlas_slot_rect(level, PLACEHOLDER_SLOT);
+    AtlasSlot *entry = atlas_claim(sprite, palette, level);
+    if (entry == NULL) {
+        return false;
+    }
+    if (visible) {
+        atlas_use(level, entry);
+    }
+    if (atlas_stale(entry, sprite)) {
+        entry->version = sprite->version;
+        entry->palette_version = PALETTE_VERSION;
+        if (!thumb_enqueue(sprite, palette, level, !visible)) {
+            if (THUMBS.worker_count == 0 && visible) {
+                // no workers, decode right here
+                atlas_upload(sprite, palette, level);
+            } else {
+                // try again next frame
+                entry->palette_version = 0;
+            }
+        }
+    }
+    if (entry->ready) {
+        *rect = atlas_slot_rect(level, sprite->slots[level]);
+    }
+    return entry->ready;
+}
+
+void rgbaslider(Rectangle rect, unsigned char *component, char *name) {
+    RectTuple split = vsplit(rect, 1, 4);
+    draw_text(name, split.r1.x, split.r1.y, 0.8 * split.r1.height, 0,
+              TEXT_COLOR);
+    float r = slider_region(split.r2, *component / 255.0);
+    if (r != -1) {
+        *component = 255.0 * r;
+    }
+}
+
+void color_sliders(Color *color, Rectangle rect) {
+    RectTuple split = chop_top(rect, TITLE_BAR);
+    DrawText(
+        TextFormat("#%02X%02X%02X%02X", color->r, color->g, color->b, color->a),
+        rect.x, rect.y, TITLE_BAR * 15 / 20, WHITE);
+
+    rgbaslider(vsubdivide(split.r2, 4, 0), &color->r, "R");
+    rgbaslider(vsubdivide(split.r2, 4, 1), &color->g, "G");
+    rgbaslider(vsubdivide(split.r2, 4, 2), &color->b, "B");
+    rgbaslider(vsubdivide(split.r2, 4, 3), &color->a, "A");
+}
+
+// rect comes from fit_square_factor(area, 8)
+void color_selector(Rectangle rect, bool hovered, int *selected,
+                    Color *colors) {
+    if (IsKeyPressed(KEY_ESCAPE)) {
+        *selected = -1;
+    }
+    int hovered_pad = -1;
+    if (hovered) {
+        Vector2 mouse = GetMousePosition();
+        int x = (mouse.x - rect.x) * 4 / rect.width;
+        int y = (mouse.y - rect.y) * 4 / rect.height;
+        hovered_pad = Clamp(y, 0, 3) * 4 + Clamp(x, 0, 3);
+    }
+    for (int i = 0; i < NUM_COLORS; i++) {
+        int x = i % 4;
+        int y = i / 4;
+        Rectangle colorpad = {
+            .x = rect.x + x * rect.width / 4,
+            .y = rect.y + y * rect.height / 4,
+            .width = rect.width / 4,
+            .height = rect.height / 4,
+        };
+        DrawRectangleRec(colorpad, colors[i]);
+
+        Color opaque = colors[i];
+        opaque.a = 0xFF;
+        Rectangle opaque_r = (Rectangle){
+            rect.x + x * rect.width / 4,
+            rect.y + y * rect.height / 4,
+            rect.width / 8,
+            rect.height / 8,
+        };
+        DrawRectangleRec(opaque_r, opaque);
+
+        opaque_r.x += opaque_r.width;
+        opaque_r.y += opaque_r.height;
+        DrawRectangleRec(opaque_r, opaque);
+
+        if (clickable(colorpad, i == hovered_pad)) {
+            *selected = i;
+        }
+        if (*selected == i) {
+            draw_dashed_outline(colorpad, MARK_LINE_THICK, 5);
+        }
+    }
+}
+
+// Preview of the sprites under NEW_COLORS while the palette is edited. The
+// sprites are copied once into a texture of color indices, and a shader
+// looks every index up in a 16x1 texture of NEW_COLORS. Moving a slider only
+// uploads those 16 colors, the sprites are not decoded again.
+const char *PALETTE_SHADER =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "uniform sampler2D palette;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    float index = texture(texture0, fragTexCoord).r * 255.0;\n"
+    "    vec2 entry = vec2((index + 0.5) / 16.0, 0.5);\n"
+    "    finalColor = texture(palette, entry) * fragColor;\n"
+    "}\n";
+
+typedef struct {
+    Shader shader;
+    int palette_location;
+    Texture2D palette;
+    // the previewed sprites in a grid, one byte per pixel
+    Texture2D indices;
+    int first;
+    int count;
+    int columns;
+    int rows;
+    // only sprites drawn in this palette are previewed
+    int sprite_palette;
+} PalettePreview;
+
+PalettePreview PREVIEW = {0};
+
+void palette_preview_load(int first) {
+    PalettePreview *preview = &PREVIEW;
+    preview->shader = LoadShaderFromMemory(NULL, PALETTE_SHADER);
+    preview->palette_location =
+        GetShaderLocation(preview->shader, "palette");
+    Image palette = {
+        .data = NEW_COLORS,
+        .width = NUM_COLORS,
+        .height = 1,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    preview->palette = LoadTextureFromImage(palette);
+    preview->first = first < SPRITES.count ? first : 0;
+    preview->columns = 0;
+    preview->rows = 0;
+}
+
+// Copies the sprites in palette that fit into a grid of the given size into
+// the index texture, if they are not there already. They are taken from
+// first on, wrapping around to the start of the bank.
+void palette_preview_fill(int columns, int rows, int palette) {
+    PalettePreview *preview = &PREVIEW;
+    if (columns == preview->columns && rows == preview->rows &&
+        palette == preview->sprite_palette) {
+        return;
+    }
+    if (preview->indices.id != 0) {
+        UnloadTexture(preview->indices);
+        preview->indices = (Texture2D){0};
+    }
+    preview->columns = columns;
+    preview->rows = rows;
+    preview->sprite_palette = palette;
+    preview->count = 0;
+    if (columns <= 0 || rows <= 0) {
+        return;
+    }
+    int width = columns * SPRITE_SIZE;
+    int height = rows * SPRITE_SIZE;
+    unsigned char *indices = malloc((size_t)width * height);
+    memset(indices, TRANSPARENT_INDEX, (size_t)width * height);
+    for (int n = 0; n < SPRITES.count && preview->count < columns * rows;
+         n++) {
+        const Sprite *sprite =
+            &SPRITES.items[(preview->first + n) % SPRITES.count];
+        if (sprite->palette != palette) {
+            continue;
+        }
+        const unsigned char *pixels = sprite->pixels;
+        int k = preview->count++;
+        unsigned char *cell = indices + k / columns * SPRITE_SIZE * width +
+                              k % columns * SPRITE_SIZE;
+        for (int y = 0; y < SPRITE_SIZE; y++) {
+            uint64_t row = load_row(pixels + y * ROW_BYTES);
+            for (int x = 0; x < SPRITE_SIZE; x++, row >>= 4) {
+                cell[y * width + x] = row & 0xF;
+            }
+        }
+    }
+    if (preview->count == 0) {
+        free(indices);
+        return;
+    }
+    Image image = {
+        .data = indices,
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+    };
+    preview->indices = LoadTextureFromImage(image);
+    free(indices);
+}
+
+// draws sprite k of the preview into dst
+void palette_preview_sprite(int k, Rectangle dst) {
+    PalettePreview *preview = &PREVIEW;
+    Rectangle src = {
+        .x = k % preview->columns * SPRITE_SIZE,
+        .y = k / preview->columns * SPRITE_SIZE,
+        .width = SPRITE_SIZE,
+        .height = SPRITE_SIZE,
+    };
+    DrawTexturePro(preview->indices, src, dst, (Vector2){0}, 0, WHITE);
+}
+
+// The sprite under the mouse, or the first one, big on the left and a grid
+// of the others on the right, all of them sprites drawn in palette.
+void palette_preview(Rectangle rect, int palette) {
+    PalettePreview *preview = &PREVIEW;
+    if (preview->palette_location < 0) {
+        // the shader did not compile
+        return;
+    }
+    RectTuple split = vsplit(rect, 1, 2);
+    Rectangle canvas = fit_square_factor(split.r1, SPRITE_SIZE);
+    Rectangle grid = split.r2;
+    int size = 2 * SPRITE_SIZE;
+    palette_preview_fill(grid.width / size, grid.height / size, palette);
+    if (preview->count <= 0) {
+        return;
+    }
+    UpdateTexture(preview->palette, NEW_COLORS);
+
+    int shown = 0;
+    Vector2 mouse = GetMousePosition();
+    Rectangle cells = {
+        grid.x, grid.y, preview->columns * size, preview->rows * size,
+    };
+    if (CheckCollisionPointRec(mouse, cells)) {
+        int k = (int)((mouse.y - grid.y) / size) * preview->columns +
+                (mouse.x - grid.x) / size;
+        shown = k < preview->count ? k : 0;
+    }
+    BeginShaderMode(preview->shader);
+    SetShaderValueTexture(preview->shader, preview->palette_location,
+                          preview->palette);
+    palette_preview_sprite(shown, canvas);
+    // all complete rows in one quad, the rest sprite by sprite
+    int full_rows = preview->count / preview->columns;
+    if (full_rows > 0) {
+        Rectangle src = {
+            0, 0, preview->columns * SPRITE_SIZE, full_rows * SPRITE_SIZE,
+        };
+        Rectangle dst = {
+            grid.x, grid.y, preview->columns * size, full_rows * size,
+        };
+        DrawTexturePro(preview->indices, src, dst, (Vector2){0}, 0, WHITE);
+    }
+    for (int k = full_rows * preview->columns; k < preview->count; k++) {
+        palette_preview_sprite(
+            k, (Rectangle){grid.x + k % preview->columns * size,
+                           grid.y + k / preview->columns * size, size, size});
+    }
+    EndShaderMode();
+}
+
+void palette_preview_unload() {
+    PalettePreview *preview = &PREVIEW;
+    UnloadShader(preview->shader);
+    UnloadTexture(preview->palette);
+    if (preview->indices.id != 0) {
+        UnloadTexture(preview->indices);
+    }
+    *preview = (PalettePreview){0};
+}
+
+enum {
+    PALETTE_COLORS,
+    PALETTE_PREVIEW,
+    PALETTE_SLIDERS,
+    PALETTE_EXIT,
+    PALETTE_NEW,
+    PALETTE_SAVE,
+    PALETTE_RECTS,
+};
+
+void palette_layout(Rectangle screen, Rectangle *rects) {
+    RectTuple main_split = vsplit(screen, 3, 2);
+    RectTuple color_split = hsplit(main_split.r1, 1, 1);
+    rects[PALETTE_COLORS] = fit_square_factor(color_split.r1, 8);
+    rects[PALETTE_PREVIEW] = color_split.r2;
+    RectTuple edit_split = chop_bottom(main_split.r2, BUTTON_HEIGHT);
+    rects[PALETTE_SLIDERS] = edit_split.r1;
+    RectTuple button_split = vsplit(edit_split.r2, 1, 2);
+    rects[PALETTE_EXIT] = button_split.r1;
+    RectTuple save_split = vsplit(button_split.r2, 1, 1);
+    rects[PALETTE_NEW] = save_split.r1;
+    rects[PALETTE_SAVE] = save_split.r2;
+}
+
+Layout PALETTE_LAYOUT = {.build = palette_layout, .count = PALETTE_RECTS};
+
+// first_sprite is where the preview starts, tab moves on to the next palette
+// and drops unsaved changes
+void edit_colors(int first_sprite) {
+    int selected = -1;
+    int palette = 0;
+    bool should_exit = false;
+    Layout *layout = &PALETTE_LAYOUT;
+    palette_preview_load(first_sprite);
+
+    while (!should_exit) {
+        Rectangle *rects = layout_begin(layout);
+
+        if (IsKeyPressed(KEY_TAB) && PALETTE_COUNT > 1) {
+            palette = (palette + 1) % PALETTE_COUNT;
+            memcpy(NEW_COLORS, PALETTES[palette], NUM_COLORS * sizeof(Color));
+        }
+
+        BeginDrawing();
+        ClearBackground(BACKGROUND);
+
+        if (PALETTE_COUNT > 1) {
+            draw_title(TextFormat("Editing Color Palette %d of %d",
+                                  palette + 1, PALETTE_COUNT));
+        } else {
+            draw_title("Editing Color Palette");
+        }
+
+        color_selector(rects[PALETTE_COLORS],
+                       layout->hovered == PALETTE_COLORS, &selected,
+                       (Color *)&NEW_COLORS);
+
+        if (selected >= 0) {
+            color_sliders(&NEW_COLORS[selected], rects[PALETTE_SLIDERS]);
+        }
+        palette_preview(rects[PALETTE_PREVIEW], palette);
+
+        should_exit = layout_button(layout, PALETTE_EXIT, "exit", BUTTON_COLOR);
+
+        // the new palette starts out as a copy of the edited one
+        if (PALETTE_COUNT < MAX_PALETTES &&
+            layout_button(layout, PALETTE_NEW, "new", BUTTON_COLOR)) {
+            palette = PALETTE_COUNT++;
+            memcpy(PALETTES[palette], NEW_COLORS, NUM_COLORS * sizeof(Color));
+            PALETTE_VERSION++;
+        }
+        if (layout_button(layout, PALETTE_SAVE, "save", BUTTON_COLOR)) {
+            memcpy(PALETTES[palette], NEW_COLORS, NUM_COLORS * sizeof(Color));
+            PALETTE_VERSION++;
+        }
+        EndDrawing();
+    }
+    palette_preview_unload();
+    if (palette != 0) {
+        memcpy(NEW_COLORS, COLORS, NUM_COLORS * sizeof(Color));
+    }
+}
+
+typedef struct {
+    // stored at the top left corner
+    unsigned char pixels[SPRITE_BYTES];
+    int width;
+    int height;
+} Clip;
+
+// shared by all sprites, so cut and paste also moves pixels between sprites
+Clip CLIPBOARD = {0};
+
+typedef struct {
+    // in sprite pixels
+    int x;
+    int y;
+    int width;
+    int height;
+    bool active;
+    // the selected pixels were lifted off the active layer and are being moved
+    bool floating;
+    Clip content;
+    // when dropping, pixels of TRANSPARENT_INDEX keep what is underneath
+    bool skip_transparent;
+    int anchor_x;
+    int anchor_y;
+    bool dragging_outline;
+    bool dragging_content;
+} Selection;
+
+Selection SELECTION = {0};
+
+unsigned char *active_layer_pixels() {
+    return EDIT_LAYERS.items[ACTIVE_LAYER].pixels;
+}
+
+void copy_selection() {
+    if (SELECTION.floating) {
+        CLIPBOARD = SELECTION.content;
+        return;
+    }
+    CLIPBOARD.width = SELECTION.width;
+    CLIPBOARD.height = SELECTION.height;
+    // the part of the selection off the canvas copies as transparent
+    fill_transparent(CLIPBOARD.pixels);
+    blit_rect(CLIPBOARD.pixels, 0, 0, active_layer_pixels(), SELECTION.x,
+              SELECTION.y, SELECTION.width, SELECTION.height, false);
+}
+
+void lift_selection() {
+    Clip *content = &SELECTION.content;
+    content->width = SELECTION.width;
+    content->height = SELECTION.height;
+    fill_transparent(content->pixels);
+    blit_rect(content->pixels, 0, 0, active_layer_pixels(), SELECTION.x,
+              SELECTION.y, SELECTION.width, SELECTION.height, false);
+    fill_rect(active_layer_pixels(), SELECTION.x, SELECTION.y,
+              SELECTION.width, SELECTION.height, TRANSPARENT_INDEX);
+    SELECTION.floating = true;
+    composite_edit_layers();
+}
+
+void drop_selection() {
+    if (!SELECTION.floating) {
+        return;
+    }
+    blit_rect(active_layer_pixels(), SELECTION.x, SELECTION.y,
+              SELECTION.content.pixels, 0, 0, SELECTION.content.width,
+              SELECTION.content.height, SELECTION.skip_transparent);
+    SELECTION.floating = false;
+    composite_edit_layers();
+}
+
+void clear_selection() {
+    if (SELECTION.floating) {
+        SELECTION.floating = false;
+    } else {
+        fill_rect(active_layer_pixels(), SELECTION.x, SELECTION.y,
+                  SELECTION.width, SELECTION.height, TRANSPARENT_INDEX);
+        composite_edit_layers();
+    }
+}
+
+void paste_clipboard() {
+    drop_selection();
+    if (!SELECTION.active) {
+        SELECTION.x = 0;
+        SELECTION.y = 0;
+    }
+    SELECTION.content = CLIPBOARD;
+    SELECTION.width = CLIPBOARD.width;
+    SELECTION.height = CLIPBOARD.height;
+    SELECTION.active = true;
+    SELECTION.floating = true;
+}
+
+// Rectangular selection on the canvas. Dragging outside the selection
+// selects, dragging inside moves the selected pixels.
+void selection_tool(Rectangle sprite_rect, int pixel_scale,
+                    bool *was_changed) {
+    Vector2 mouse = GetMousePosition();
+    int mx = floor((mouse.x - sprite_rect.x) / pixel_scale);
+    int my = floor((mouse.y - sprite_rect.y) / pixel_scale);
+    bool inside = SELECTION.active && mx >= SELECTION.x &&
+                  mx < SELECTION.x + SELECTION.width && my >= SELECTION.y &&
+                  my < SELECTION.y + SELECTION.height;
+
+    if (IsMouseButtonPressed(0) &&
+        CheckCollisionPointRec(mouse, sprite_rect)) {
+        if (inside) {
+            if (!SELECTION.floating) {
+                lift_selection();
+                *was_changed = true;
+            }
+            SELECTION.anchor_x = mx - SELECTION.x;
+            SELECTION.anchor_y = my - SELECTION.y;
+            SELECTION.dragging_content = true;
+        } else {
+            drop_selection();
+            SELECTION.active = true;
+            SELECTION.anchor_x = mx;
+            SELECTION.anchor_y = my;
+            SELECTION.dragging_outline = true;
+        }
+    }
+    if (!IsMouseButtonDown(0)) {
+        SELECTION.dragging_outline = false;
+        SELECTION.dragging_content = false;
+    }
+    if (SELECTION.dragging_content) {
+        SELECTION.x = Clamp(mx - SELECTION.anchor_x, 1 - SELECTION.width,
+                            SPRITE_SIZE - 1);
+        SELECTION.y = Clamp(my - SELECTION.anchor_y, 1 - SELECTION.height,
+                            SPRITE_SIZE - 1);
+    }
+    if (SELECTION.dragging_outline) {
+        mx = Clamp(mx, 0, SPRITE_SIZE - 1);
+        my = Clamp(my, 0, SPRITE_SIZE - 1);
+        SELECTION.x = fmin(mx, SELECTION.anchor_x);
+        SELECTION.y = fmin(my, SELECTION.anchor_y);
+        SELECTION.width = abs(mx - SELECTION.anchor_x) + 1;
+        SELECTION.height = abs(my - SELECTION.anchor_y) + 1;
+    }
+
+    if (IsKeyPressed(KEY_T)) {
+        SELECTION.skip_transparent = !SELECTION.skip_transparent;
+    }
+    if (command_down() && IsKeyPressed(KEY_V) && CLIPBOARD.width > 0) {
+        paste_clipboard();
+        *was_changed = true;
+    }
+    if (!SELECTION.active) {
+        return;
+    }
+    if (command_down() && IsKeyPressed(KEY_C)) {
+        copy_selection();
+    }
+    if (command_down() && IsKeyPressed(KEY_X)) {
+        copy_selection();
+        clear_selection();
+        *was_changed = true;
+    }
+    if (IsKeyPressed(KEY_DELETE) || IsKeyPressed(KEY_BACKSPACE)) {
+        clear_selection();
+        *was_changed = true;
+    }
+    if (IsKeyPressed(KEY_ENTER) || IsKeyPressed(KEY_ESCAPE)) {
+        drop_selection();
+        SELECTION.active = false;
+    }
+}
+
+// returns true if the layer stack or the active layer changed
+bool layer_panel(Rectangle rect, bool *was_changed) {
+    bool changed = false;
+    RectTuple split = chop_bottom(rect, BUTTON_HEIGHT);
+    RectTuple buttons = vsplit(split.r2, 1, 1);
+
+    if (button("add layer", buttons.r1, BUTTON_COLOR)) {
+        Layer layer = {.visible = true};
+        fill_transparent(layer.pixels);
+        da_append(&EDIT_LAYERS, layer);
+        int above = ACTIVE_LAYER + 1;
+        memmove(&EDIT_LAYERS.items[above + 1], &EDIT_LAYERS.items[above],
+                (EDIT_LAYERS.count - above - 1) * sizeof(Layer));
+        EDIT_LAYERS.items[above] = layer;
+        ACTIVE_LAYER = above;
+        *was_changed = true;
+        changed = true;
+    }
+    if (EDIT_LAYERS.count > 1 &&
+        button("remove", buttons.r2, BUTTON_COLOR)) {
+        memmove(&EDIT_LAYERS.items[ACTIVE_LAYER],
+                &EDIT_LAYERS.items[ACTIVE_LAYER + 1],
+                (EDIT_LAYERS.count - ACTIVE_LAYER - 1) * sizeof(Layer));
+        EDIT_LAYERS.count--;
+        if (ACTIVE_LAYER > 0) {
+            ACTIVE_LAYER--;
+        }
+        *was_changed = true;
+        changed = true;
+    }
+
+    // topmost layer first, scrolled so that the active layer stays visible
+    int rows = (split.r1.height + LITTLE_MARGIN) /
+               (BUTTON_HEIGHT + LITTLE_MARGIN);
+    int first = EDIT_LAYERS.count - 1;
+    if (rows > 0 && EDIT_LAYERS.count - 1 - ACTIVE_LAYER >= rows) {
+        first = ACTIVE_LAYER + rows - 1;
+    }
+    for (int row = 0; row < rows && first - row >= 0; row++) {
+        int i = first - row;
+        Layer *layer = &EDIT_LAYERS.items[i];
+        Rectangle r_row = {
+            .x = split.r1.x,
+            .y = split.r1.y + row * (BUTTON_HEIGHT + LITTLE_MARGIN),
+            .width = split.r1.width,
+            .height = BUTTON_HEIGHT,
+        };
+        RectTuple row_split = vsplit(r_row, 3, 1);
+        Color color = i == ACTIVE_LAYER ? DARKGRAY : BUTTON_COLOR;
+        if (button(TextFormat("Layer %d", i + 1), row_split.r1, color)) {
+            ACTIVE_LAYER = i;
+            changed = true;
+        }
+        if (button(layer->visible ? "on" : "off", row_split.r2,
+                   BUTTON_COLOR)) {
+            layer->visible = !layer->visible;
+            *was_changed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+enum {
+    EDIT_CANVAS,
+    EDIT_COLORS,
+    EDIT_LAYER_PANEL,
+    EDIT_SAVE,
+    EDIT_EXIT,
+    EDIT_RECTS,
+};
+
+void edit_layout(Rectangle screen, Rectangle *rects) {
+    RectTuple main_split = vsplit(screen, 3, 2);
+    rects[EDIT_CANVAS] = fit_square_factor(main_split.r1, 16);
+    RectTuple edit_split = chop_bottom(main_split.r2, BUTTON_HEIGHT);
+    RectTuple tool_split = hsplit(edit_split.r1, 3, 2);
+    rects[EDIT_COLORS] = fit_square_factor(tool_split.r1, 8);
+    rects[EDIT_LAYER_PANEL] = tool_split.r2;
+    RectTuple buttons = vsplit(edit_split.r2, 1, 1);
+    rects[EDIT_SAVE] = buttons.r1;
+    rects[EDIT_EXIT] = buttons.r2;
+}
+
+Layout EDIT_LAYOUT = {.build = edit_layout, .count = EDIT_RECTS};
+
+// The previous and next frame while onion skinning. Unlike the atlas images
+// they are decoded with TRANSPARENT_INDEX cleared, so each frame is a single
+// faded quad, and they are decoded again only when the frame changes.
+typedef struct {
+    Texture2D texture;
+    unsigned int owner;
+    unsigned int version;
+    int palette;
+    unsigned int palette_version;
+} OnionFrame;
+
+OnionFrame ONION[2] = {0};
+
+bool onion_stale(OnionFrame *onion, Sprite *frame) {
+    return onion->owner != frame->id || onion->version != frame->version ||
+           onion->palette != frame->palette ||
+           onion->palette_version != PALETTE_VERSION;
+}
+
+void draw_onion_frame(OnionFrame *onion, Sprite *frame, Rectangle rect) {
+    if (onion->texture.id == 0) {
+        Image blank = GenImageColor(SPRITE_SIZE, SPRITE_SIZE, BLANK);
+        onion->texture = LoadTextureFromImage(blank);
+        UnloadImage(blank);
+    }
+    if (onion_stale(onion, frame)) {
+        Color rgba[SPRITE_SIZE * SPRITE_SIZE];
+        decode_sprite(frame->pixels, *display_lut(frame->palette), rgba);
+        for (int i = 0; i < SPRITE_SIZE * SPRITE_SIZE; i++) {
+            int index = frame->pixels[i / 2] >> (i % 2 * 4) & 0x0F;
+            if (index == TRANSPARENT_INDEX) {
+                rgba[i] = BLANK;
+            }
+        }
+        UpdateTexture(onion->texture, rgba);
+        onion->owner = frame->id;
+        onion->version = frame->version;
+        onion->palette = frame->palette;
+        onion->palette_version = PALETTE_VERSION;
+    }
+    Rectangle source = {0, 0, SPRITE_SIZE, SPRITE_SIZE};
+    DrawTexturePro(onion->texture, source, rect, (Vector2){0}, 0,
+                   Fade(WHITE, ONION_ALPHA));
+}
+
+void onion_unload() {
+    for (int i = 0; i < (int)ARRAY_LEN(ONION); i++) {
+        if (ONION[i].texture.id != 0) {
+            UnloadTexture(ONION[i].texture);
+        }
+        ONION[i] = (OnionFrame){0};
+    }
+}
+
+void edit_sprite(int idx) {
+    begin_layer_edit(&SPRITES.items[idx]);
+    DISPLAYCOLORS = PALETTES[SPRITES.items[idx].palette];
+    Layout *layout = &EDIT_LAYOUT;
+    bool was_changed = false;
+    char *name = SPRITES.items[idx].name;
+    int color = -1;
+    bool onion = false;
+    bool select_mode = false;
+    SELECTION = (Selection){0};
+start:
+    bool should_exit = false;
+    while (!should_exit) {
+        if (!command_down() && IsKeyPressed(KEY_O)) {
+            onion = !onion;
+        }
+        if (!command_down() && IsKeyPressed(KEY_S)) {
+            drop_selection();
+            SELECTION.active = false;
+            select_mode = !select_mode;
+        }
+        if (command_down() && IsKeyPressed(KEY_V)) {
+            select_mode = true;
+        }
+        software_render_shortcut();
+        int transform = transform_pressed();
+        if (transform >= 0) {
+            drop_selection();
+            da_foreach(Layer, layer, &EDIT_LAYERS) {
+                transform_pixels(layer->pixels, transform);
+            }
+            rebuild_layer_cache();
+            composite_edit_layers();
+            was_changed = true;
+        }
+        SetMouseCursor(0);
+        Rectangle *rects = layout_begin(layout);
+        shm_publish();
+        atlas_begin_frame();
+        BeginDrawing();
+        ClearBackground(BACKGROUND);
+        draw_title(TextFormat("Edit Sprite: %s%s%s", name,
+                              onion ? " (onion)" : "",
+                              select_mode ? " (select)" : ""));
+
+        Rectangle sprite_rect = rects[EDIT_CANVAS];
+        bool on_canvas = layout->hovered == EDIT_CANVAS;
+        if (on_canvas) {
+            SetMouseCursor(MOUSE_CURSOR_CROSSHAIR);
+        } else {
+            SetMouseCursor(0);
+        }
+        int pixel_scale = sprite_rect.width / 16;
+        if (onion) {
+            // neighbouring sprites are treated as the previous and next frame
+            for (int frame = idx - 1; frame <= idx + 1; frame += 2) {
+                if (frame < 0 || frame >= SPRITES.count) {
+                    continue;
+                }
+                draw_onion_frame(&ONION[frame > idx], &SPRITES.items[frame],
+                                 sprite_rect);
+            }
+        }
+        if (select_mode) {
+            selection_tool(sprite_rect, pixel_scale, &was_changed);
+        }
+        if (SELECTION.floating) {
+            unsigned char preview[SPRITE_BYTES];
+            memcpy(preview, &EDIT_BUF, SPRITE_BYTES);
+            blit_rect(preview, SELECTION.x, SELECTION.y,
+                      SELECTION.content.pixels, 0, 0, SELECTION.content.width,
+                      SELECTION.content.height, SELECTION.skip_transparent);
+            draw_sprite(preview, pixel_scale, sprite_rect.x, sprite_rect.y,
+                        onion);
+        } else {
+            draw_sprite((unsigned char *)&EDIT_BUF, pixel_scale,
+                        sprite_rect.x, sprite_rect.y, onion);
+        }
+        if (SELECTION.active) {
+            Rectangle outline = {
+                .x = sprite_rect.x + SELECTION.x * pixel_scale,
+                .y = sprite_rect.y + SELECTION.y * pixel_scale,
+                .width = SELECTION.width * pixel_scale,
+                .height = SELECTION.height * pixel_scale,
+            };
+            draw_dashed_outline(outline, (float)MARK_LINE_THICK / 5 * 3,
+                                2 * (SELECTION.width + SELECTION.height));
+        }
+        if (!select_mode && on_canvas) {
+            // the pixel under the mouse follows from its position
+            Vector2 mouse = GetMousePosition();
+            int x = Clamp((mouse.x - sprite_rect.x) / pixel_scale, 0,
+                          SPRITE_SIZE - 1);
+            int y = Clamp((mouse.y - sprite_rect.y) / pixel_scale, 0,
+                          SPRITE_SIZE - 1);
+            int i = y * SPRITE_SIZE + x;
+            Rectangle region = {
+                .x = sprite_rect.x + x * pixel_scale,
+                .y = sprite_rect.y + y * pixel_scale,
+                .width = pixel_scale,
+                .height = pixel_scale,
+            };
+            if (color != -1 && pixel(region, DISPLAYCOLORS[color])) {
+                was_changed = true;
+                unsigned char *layer = EDIT_LAYERS.items[ACTIVE_LAYER].pixels;
+                unsigned char double_pixel = layer[i / 2];
+                if (i % 2 == 0) {
+                    double_pixel &= 0xF0;
+                    double_pixel += (unsigned char)color;
+                } else {
+                    double_pixel &= 0x0F;
+                    double_pixel += (unsigned char)color << 4;
+                }
+                layer[i / 2] = double_pixel;
+                composite_edit_layers();
+            }
+        }
+
+        color_selector(rects[EDIT_COLORS], layout->hovered == EDIT_COLORS,
+                       &color, DISPLAYCOLORS);
+        if (layer_panel(rects[EDIT_LAYER_PANEL], &was_changed)) {
+            rebuild_layer_cache();
+            composite_edit_layers();
+        }
+
+        if (layout_button(layout, EDIT_SAVE, "save", BUTTON_COLOR)) {
+            drop_selection();
+            commit_layer_edit(&SPRITES.items[idx]);
+            was_changed = false;
+        }
+        if (layout_button(layout, EDIT_EXIT, "exit", BUTTON_COLOR)) {
+            should_exit = true;
+        }
+        EndDrawing();
+    }
+    drop_selection();
+
+    if (was_changed) {
+        char *opts[] = {
+            "Discard",
+            "Keep",
+        };
+
+        switch (button_list_popup("Discard Changes?", 2, opts, 1)) {
+        case -1:
+            goto start;
+        case 1:
+            commit_layer_edit(&SPRITES.items[idx]);
+
+        case 0:
+        }
+    }
+    onion_unload();
+    DISPLAYCOLORS = PALETTES[0];
+    return;
+}
+
+void edit_new() {
+    unsigned char *ptr = malloc(sizeof(char) * SPRITE_SIZE * SPRITE_SIZE / 2);
+    memset(ptr, 0, sizeof(char) * SPRITE_SIZE * SPRITE_SIZE / 2);
+
+    if (ptr == NULL) {
+        TraceLog(LOG_FATAL, "could not allocate new sprite");
+        abort();
+    }
+    char *name = string_popup("Enter sprite name:", "", MAX_NAME_LEN);
+    if (name == NULL) {
+        TraceLog(LOG_FATAL, "could not allocate new sprite");
+        abort();
+    }
+    Sprite entry = {
+        .name = name,
+        .pixels = ptr,
+        .id = NEXT_SPRITE_ID++,
+    };
+    da_append(&SPRITES, entry);
+    shm_mark_moved(SPRITES.count - 1);
+    edit_sprite(SPRITES.count - 1);
+}
+
+int SELECTED_COUNT = 0;
+// start of shift click ranges
+int SELECT_ANCHOR = 0;
+
+void count_selected() {
+    SELECTED_COUNT = 0;
+    da_foreach(Sprite, s, &SPRITES) { SELECTED_COUNT += s->selected; }
+}
+
+void select_all(bool selected) {
+    da_foreach(Sprite, s, &SPRITES) { s->selected = selected; }
+    SELECTED_COUNT = selected ? SPRITES.count : 0;
+}
+
+void selected_indices(IntList *out) {
+    out->count = 0;
+    da_reserve(out, SELECTED_COUNT);
+    for (int i = 0; i < SPRITES.count; i++) {
+        if (SPRITES.items[i].selected) {
+            out->items[out->count++] = i;
+        }
+    }
+}
+
+// Every bulk operation records only what it changed, keyed by sprite id, so
+// undoing it leaves alone whatever was edited, added or reloaded since.
+typedef enum {
+    // the removed sprites and the indices they were at
+    UNDO_DELETE,
+    // the duplicated or imported sprites
+    UNDO_INSERT,
+    // the moved sprites and their rank in the old order
+    UNDO_REORDER,
+    // the transformed sprites
+    UNDO_TRANSFORM,
+    // the renamed sprites and their old names
+    UNDO_RENAME,
+    // the sprites moved on to another palette and the old palette
+    UNDO_PALETTE,
+} UndoKind;
+
+typedef struct {
+    unsigned id;
+    // old index, rank or palette, depending on the kind
+    int value;
+    char *name;
+} UndoEntry;
+
+typedef struct {
+    UndoKind kind;
+    // sorted by id, except for UNDO_DELETE where they are by index
+    UndoEntry *items;
+    int count;
+    int capacity;
+    // UNDO_DELETE: the removed sprites in the order of the entries
+    SpriteList removed;
+    // UNDO_TRANSFORM: reverts the transform
+    Transform inverse;
+    // UNDO_INSERT: palette slot added by an import, 0 if none
+    int palette;
+} UndoRecord;
+
+enum { UNDO_DEPTH = 16 };
+UndoRecord UNDO[UNDO_DEPTH] = {0};
+int UNDO_COUNT = 0;
+
+const Transform TRANSFORM_INVERSE[] = {
+    [TRANSFORM_FLIP_H] = TRANSFORM_FLIP_H,
+    [TRANSFORM_FLIP_V] = TRANSFORM_FLIP_V,
+    [TRANSFORM_ROTATE_CW] = TRANSFORM_ROTATE_CCW,
+    [TRANSFORM_ROTATE_CCW] = TRANSFORM_ROTATE_CW,
+    [TRANSFORM_SHIFT_LEFT] = TRANSFORM_SHIFT_RIGHT,
+    [TRANSFORM_SHIFT_RIGHT] = TRANSFORM_SHIFT_LEFT,
+    [TRANSFORM_SHIFT_UP] = TRANSFORM_SHIFT_DOWN,
+    [TRANSFORM_SHIFT_DOWN] = TRANSFORM_SHIFT_UP,
+};
+
+void free_undo_record(UndoRecord *record) {
+    da_foreach(UndoEntry, entry, record) { free(entry->name); }
+    da_free(*record);
+    free_sprite_list(&record->removed);
+    *record = (UndoRecord){0};
+}
+
+int compare_undo_entries(const void *a, const void *b) {
+    unsigned ia = ((const UndoEntry *)a)->id;
+    unsigned ib = ((const UndoEntry *)b)->id;
+    return (ia > ib) - (ia < ib);
+}
+
+UndoEntry *find_undo_entry(UndoRecord *record, unsigned id) {
+    UndoEntry key = {.id = id};
+    return bsearch(&key, record->items, record->count, sizeof(UndoEntry),
+                   compare_undo_entries);
+}
+
+// takes over the record, one that changed nothing is dropped
+void push_undo(UndoRecord *record) {
+    if (record->count == 0) {
+        free_undo_record(record);
+        return;
+    }
+    if (record->kind != UNDO_DELETE) {
+        qsort(record->items, record->count, sizeof(UndoEntry),
+              compare_undo_entries);
+    }
+    if (UNDO_COUNT == UNDO_DEPTH) {
+        free_undo_record(&UNDO[0]);
+        memmove(&UNDO[0], &UNDO[1], (UNDO_DEPTH - 1) * sizeof(UndoRecord));
+        UNDO_COUNT--;
+    }
+    UNDO[UNDO_COUNT++] = *record;
+    *record = (UndoRecord){0};
+}
+
+// puts the removed sprites back where they were, or at the end if the store
+// has shrunk since, in one pass from the back
+void undo_delete(UndoRecord *record) {
+    int old_count = SPRITES.count;
+    int count = record->count;
+    da_resize(&SPRITES, old_count + count);
+    int j = count - 1;
+    int src = old_count - 1;
+    for (int dst = SPRITES.count - 1; dst >= 0; dst--) {
+        if (j >= 0 && record->items[j].value >= dst) {
+            SPRITES.items[dst] = record->removed.items[j--];
+        } else {
+            SPRITES.items[dst] = SPRITES.items[src--];
+        }
+    }
+    int first = record->items[0].value;
+    shm_mark_moved(first < old_count ? first : old_count);
+    // the sprites belong to the store again
+    record->removed.count = 0;
+}
+
+// drops the inserted sprites that are still there
+void undo_insert(UndoRecord *record) {
+    int kept = 0;
+    da_foreach(Sprite, s, &SPRITES) {
+        if (find_undo_entry(record, s->id) != NULL) {
+            shm_mark_moved(kept);
+            free_sprite(s);
+        } else {
+            SPRITES.items[kept++] = *s;
+        }
+    }
+    SPRITES.count = kept;
+    // the palette goes too, if it is still the last one and nothing uses it
+    int slot = record->palette;
+    if (slot == 0 || slot != PALETTE_COUNT - 1) {
+        return;
+    }
+    da_foreach(Sprite, s, &SPRITES) {
+        if (s->palette == slot) {
+            return;
+        }
+    }
+    PALETTE_COUNT--;
+    PALETTE_VERSION++;
+    if (GALLERY_PALETTE >= PALETTE_COUNT) {
+        GALLERY_PALETTE = -1;
+    }
+}
+
+// puts the moved sprites back into their old order within the slots they hold
+// now, sprites inserted in between stay where they are
+void undo_reorder(UndoRecord *record) {
+    int *slots = malloc(record->count * sizeof(int));
+    int *slot_of_rank = malloc(record->count * sizeof(int));
+    Sprite *moved = malloc(record->count * sizeof(Sprite));
+    for (int rank = 0; rank < record->count; rank++) {
+        slot_of_rank[rank] = -1;
+    }
+    int found = 0;
+    for (int i = 0; i < SPRITES.count; i++) {
+        UndoEntry *entry = find_undo_entry(record, SPRITES.items[i].id);
+        if (entry != NULL) {
+            slot_of_rank[entry->value] = i;
+            slots[found++] = i;
+        }
+    }
+    int next = 0;
+    for (int rank = 0; rank < record->count; rank++) {
+        if (slot_of_rank[rank] >= 0) {
+            moved[next++] = SPRITES.items[slot_of_rank[rank]];
+        }
+    }
+    for (int i = 0; i < found; i++) {
+        if (SPRITES.items[slots[i]].id != moved[i].id) {
+            SPRITES.items[slots[i]] = moved[i];
+            shm_mark(slots[i]);
+        }
+    }
+    free(slots);
+    free(slot_of_rank);
+    free(moved);
+}
+
+void undo() {
+    if (UNDO_COUNT == 0) {
+        return;
+    }
+    UndoRecord *record = &UNDO[--UNDO_COUNT];
+    switch (record->kind) {
+    case UNDO_DELETE:
+        undo_delete(record);
+        break;
+    case UNDO_INSERT:
+        undo_insert(record);
+        break;
+    case UNDO_REORDER:
+        undo_reorder(record);
+        break;
+    case UNDO_TRANSFORM:
+    case UNDO_RENAME:
+    case UNDO_PALETTE:
+        for (int i = 0; i < SPRITES.count; i++) {
+            Sprite *s = &SPRITES.items[i];
+            UndoEntry *entry = find_undo_entry(record, s->id);
+            if (entry == NULL) {
+                continue;
+            }
+            if (record->kind == UNDO_TRANSFORM) {
+                transform_sprite(s, record->inverse);
+            } else if (record->kind == UNDO_RENAME) {
+                free(s->name);
+                s->name = entry->name;
+                entry->name = NULL;
+                shm_mark(i);
+            } else if (entry->value < PALETTE_COUNT) {
+                s->palette = entry->value;
+                shm_mark(i);
+            }
+        }
+        if (record->kind == UNDO_RENAME) {
+            text_cache_clear();
+        }
+        break;
+    }
+    free_undo_record(record);
+    count_selected();
+}
+
+void clear_undo() {
+    while (UNDO_COUNT > 0) {
+        free_undo_record(&UNDO[--UNDO_COUNT]);
+    }
+}
+
+// compacts the store in a single pass
+void delete_selected() {
+    UndoRecord record = {.kind = UNDO_DELETE};
+    int kept = 0;
+    for (int i = 0; i < SPRITES.count; i++) {
+        Sprite *s = &SPRITES.items[i];
+        if (s->selected) {
+            shm_mark_moved(kept);
+            UndoEntry entry = {.id = s->id, .value = i};
+            da_append(&record, entry);
+            da_append(&record.removed, *s);
+        } else {
+            SPRITES.items[kept++] = *s;
+        }
+    }
+    SPRITES.count = kept;
+    SELECTED_COUNT = 0;
+    push_undo(&record);
+}
+
+// inserts a copy after each selected sprite and selects the copies instead
+void duplicate_selected() {
+    UndoRecord record = {.kind = UNDO_INSERT};
+    int old_count = SPRITES.count;
+    da_resize(&SPRITES, old_count + SELECTED_COUNT);
+    // walk backwards, so every sprite is moved exactly once
+    int dst = SPRITES.count - 1;
+    for (int i = old_count - 1; i >= 0; i--) {
+        Sprite s = SPRITES.items[i];
+        if (s.selected) {
+            shm_mark_moved(i);
+            Sprite copy = clone_sprite(&s);
+            copy.id = NEXT_SPRITE_ID++;
+            UndoEntry entry = {.id = copy.id};
+            da_append(&record, entry);
+            SPRITES.items[dst--] = copy;
+            s.selected = false;
+        }
+        SPRITES.items[dst--] = s;
+    }
+    push_undo(&record);
+}
+
+// records the order of the sprites in [first, last] before they are moved
+void record_order(UndoRecord *record, int first, int last) {
+    *record = (UndoRecord){.kind = UNDO_REORDER};
+    for (int i = first; i <= last; i++) {
+        UndoEntry entry = {.id = SPRITES.items[i].id, .value = i - first};
+        da_append(record, entry);
+    }
+}
+
+// keeps only the sprites that the reorder moved, ranked among themselves
+void drop_unmoved(UndoRecord *record, int first) {
+    int kept = 0;
+    da_foreach(UndoEntry, entry, record) {
+        if (SPRITES.items[first + entry->value].id != entry->id) {
+            record->items[kept] = *entry;
+            record->items[kept].value = kept;
+            kept++;
+        }
+    }
+    record->count = kept;
+}
+
+// range of the selected sprites, false if there are none
+bool selection_range(int *first, int *last) {
+    *first = -1;
+    for (int i = 0; i < SPRITES.count; i++) {
+        if (SPRITES.items[i].selected) {
+            *first = *first < 0 ? i : *first;
+            *last = i;
+        }
+    }
+    return *first >= 0;
+}
+
+// moves every selected sprite one place past its unselected neighbour
+void move_selected(int direction) {
+    int first, last;
+    if (!selection_range(&first, &last)) {
+        return;
+    }
+    first = direction < 0 && first > 0 ? first - 1 : first;
+    last = direction > 0 && last < SPRITES.count - 1 ? last + 1 : last;
+    UndoRecord record;
+    record_order(&record, first, last);
+    Sprite *items = SPRITES.items;
+    if (direction < 0) {
+        for (int i = 1; i < SPRITES.count; i++) {
+            if (items[i].selected && !items[i - 1].selected) {
+                swap(Sprite, items[i], items[i - 1]);
+                shm_mark(i - 1);
+                shm_mark(i);
+            }
+        }
+    } else {
+        for (int i = SPRITES.count - 2; i >= 0; i--) {
+            if (items[i].selected && !items[i + 1].selected) {
+                swap(Sprite, items[i], items[i + 1]);
+                shm_mark(i);
+                shm_mark(i + 1);
+            }
+        }
+    }
+    drop_unmoved(&record, first);
+    push_undo(&record);
+}
+
+// stable partition with the selected sprites first or last
+void move_selected_to_end(bool to_front) {
+    int first, last;
+    if (!selection_range(&first, &last)) {
+        return;
+    }
+    first = to_front ? 0 : first;
+    last = to_front ? last : SPRITES.count - 1;
+    UndoRecord record;
+    record_order(&record, first, last);
+    Sprite *sorted = malloc(SPRITES.count * sizeof(Sprite));
+    int front = 0;
+    int back = to_front ? SELECTED_COUNT : SPRITES.count - SELECTED_COUNT;
+    da_foreach(Sprite, s, &SPRITES) {
+        bool goes_first = s->selected == to_front;
+        sorted[goes_first ? front++ : back++] = *s;
+    }
+    for (int i = 0; i < SPRITES.count; i++) {
+        if (sorted[i].id != SPRITES.items[i].id) {
+            shm_mark_moved(i);
+            break;
+        }
+    }
+    memcpy(SPRITES.items, sorted, SPRITES.count * sizeof(Sprite));
+    free(sorted);
+    drop_unmoved(&record, first);
+    push_undo(&record);
+}
+
+// every # in pattern is replaced by the position within the selection
+void rename_selected(const char *pattern) {
+    UndoRecord record = {.kind = UNDO_RENAME};
+    int number = 0;
+    da_foreach(Sprite, s, &SPRITES) {
+        if (!s->selected) {
+            continue;
+        }
+        char name[MAX_NAME_LEN];
+        int len = 0;
+        for (const char *c = pattern; *c && len < MAX_NAME_LEN - 1; c++) {
+            if (*c == '#') {
+                len += snprintf(name + len, MAX_NAME_LEN - len, "%d", number);
+                len = len < MAX_NAME_LEN - 1 ? len : MAX_NAME_LEN - 1;
+            } else {
+                name[len++] = *c;
+            }
+        }
+        name[len] = '\0';
+        UndoEntry entry = {.id = s->id, .name = s->name};
+        da_append(&record, entry);
+        s->name = strdup(name);
+        shm_mark(s - SPRITES.items);
+        number++;
+    }
+    text_cache_clear();
+    push_undo(&record);
+}
+
+// moves the selected sprites on to the next palette
+void cycle_selected_palette() {
+    UndoRecord record = {.kind = UNDO_PALETTE};
+    da_foreach(Sprite, s, &SPRITES) {
+        if (s->selected) {
+            UndoEntry entry = {.id = s->id, .value = s->palette};
+            da_append(&record, entry);
+            s->palette = (s->palette + 1) % PALETTE_COUNT;
+            shm_mark(s - SPRITES.items);
+        }
+    }
+    push_undo(&record);
+}
+
+void transform_selected(Transform transform) {
+    UndoRecord record = {
+        .kind = UNDO_TRANSFORM,
+        .inverse = TRANSFORM_INVERSE[transform],
+    };
+    IntList indices = {0};
+    selected_indices(&indices);
+    transform_sprites(indices.items, indices.count, transform);
+    da_foreach(int, index, &indices) {
+        UndoEntry entry = {.id = SPRITES.items[*index].id};
+        da_append(&record, entry);
+    }
+    da_free(indices);
+    push_undo(&record);
+}
+
+void export_selected() {
+    char *path = string_popup("Export selection to", "", 64);
+    if (path == NULL) {
+        return;
+    }
+    IntList indices = {0};
+    selected_indices(&indices);
+    write_sprites(path, indices.items, indices.count);
+    da_free(indices);
+    free(path);
+}
+
+// Work split into one contiguous range per core. worker is in
+// [0, parallel_worker_count()) and lets callers keep per-thread scratch.
+typedef void (*RangeFn)(void *ctx, int begin, int end, int worker);
+
+enum { MAX_PARALLEL = 64 };
+
+typedef struct {
+    RangeFn fn;
+    void *ctx;
+    int begin;
+    int end;
+    int worker;
+} RangeJob;
+
+int parallel_worker_count() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        return 1;
+    }
+    return cores > MAX_PARALLEL ? MAX_PARALLEL : cores;
+}
+
+void *run_range(void *arg) {
+    RangeJob *job = arg;
+    job->fn(job->ctx, job->begin, job->end, job->worker);
+    return NULL;
+}
+
+// Calls fn over [0, count) on all cores and returns when every range is done.
+void parallel_for(int count, RangeFn fn, void *ctx) {
+    int workers = parallel_worker_count();
+    if (workers > count) {
+        workers = count;
+    }
+    pthread_t threads[MAX_PARALLEL];
+    RangeJob jobs[MAX_PARALLEL];
+    bool started[MAX_PARALLEL] = {0};
+    for (int i = 0; i < workers; i++) {
+        jobs[i] = (RangeJob){
+            .fn = fn,
+            .ctx = ctx,
+            .begin = (int64_t)count * i / workers,
+            .end = (int64_t)count * (i + 1) / workers,
+            .worker = i,
+        };
+        // the calling thread takes the first range
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, run_range,
+                                             &jobs[i]) == 0;
+    }
+    for (int i = 0; i < workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            run_range(&jobs[i]);
+        }
+    }
+}
+
+// Importing PNG sheets: the sheet is cut into 16x16 tiles, the palette is
+// either built from all tiles or taken from COLORS, and every pixel is mapped
+// to its nearest palette entry through a lookup cube.
+//
+// Colors are binned with 5 bits per channel, both for the histogram the
+// palette is built from and for the lookup cube.
+enum {
+    CUBE_BITS = 5,
+    CUBE_SIDE = 1 << CUBE_BITS,
+    CUBE_CELLS = CUBE_SIDE * CUBE_SIDE * CUBE_SIDE,
+};
+// pixels with less alpha become TRANSPARENT_INDEX
+const unsigned char IMPORT_ALPHA_CUTOFF = 128;
+const int KMEANS_ITERATIONS = 8;
+
+typedef enum {
+    IMPORT_MATCH_PALETTE,
+    IMPORT_BUILD_PALETTE,
+} ImportPalette;
+
+typedef enum {
+    DITHER_NONE,
+    // 4x4 Bayer threshold added before the lookup
+    DITHER_ORDERED,
+    // Floyd-Steinberg, the error stays within its tile
+    DITHER_DIFFUSION,
+} ImportDither;
+
+const unsigned char BAYER4[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5},
+};
+// amplitude of the ordered dither in color units, about the distance between
+// neighbouring colors of a 16 color palette
+const int BAYER_SPREAD = 48;
+
+typedef struct {
+    const Color *pixels;
+    int width;
+    int columns;
+    int tile_count;
+    // nearest palette index per cube cell
+    unsigned char cube[CUBE_CELLS];
+    // CUBE_CELLS per worker, merged after counting
+    uint32_t *counts;
+    uint64_t (*sums)[3];
+    bool *has_transparent;
+    ImportDither dither;
+    // SPRITE_BYTES per tile
+    unsigned char *tiles;
+    bool *keep;
+    // for building the cube
+    Color palette[NUM_COLORS];
+    bool candidate[NUM_COLORS];
+} SheetImport;
+
+int cube_cell(Color c) {
+    int shift = 8 - CUBE_BITS;
+    return (c.r >> shift) << (2 * CUBE_BITS) | (c.g >> shift) << CUBE_BITS |
+           c.b >> shift;
+}
+
+Color cube_color(int cell) {
+    int shift = 8 - CUBE_BITS;
+    int half = 1 << (shift - 1);
+    return (Color){
+        .r = (cell >> (2 * CUBE_BITS) & (CUBE_SIDE - 1)) << shift | half,
+        .g = (cell >> CUBE_BITS & (CUBE_SIDE - 1)) << shift | half,
+        .b = (cell & (CUBE_SIDE - 1)) << shift | half,
+        .a = 255,
+    };
+}
+
+int color_distance(Color a, Color b) {
+    int dr = a.r - b.r;
+    int dg = a.g - b.g;
+    int db = a.b - b.b;
+    return dr * dr + dg * dg + db * db;
+}
+
+const Color *tile_row(const SheetImport *import, int tile, int y) {
+    int tx = tile % import->columns;
+    int ty = tile / import->columns;
+    return import->pixels + (size_t)(ty * SPRITE_SIZE + y) * import->width +
+           tx * SPRITE_SIZE;
+}
+
+void count_colors(void *ctx, int begin, int end, int worker) {
+    SheetImport *import = ctx;
+    uint32_t *counts = import->counts + (size_t)worker * CUBE_CELLS;
+    uint64_t(*sums)[3] = import->sums + (size_t)worker * CUBE_CELLS;
+    for (int tile = begin; tile < end; tile++) {
+        for (int y = 0; y < SPRITE_SIZE; y++) {
+            const Color *row = tile_row(import, tile, y);
+            for (int x = 0; x < SPRITE_SIZE; x++) {
+                Color c = row[x];
+                if (c.a < IMPORT_ALPHA_CUTOFF) {
+                    import->has_transparent[worker] = true;
+                    continue;
+                }
+                int cell = cube_cell(c);
+                counts[cell]++;
+                sums[cell][0] += c.r;
+                sums[cell][1] += c.g;
+                sums[cell][2] += c.b;
+            }
+        }
+    }
+}
+
+typedef struct {
+    // indices into the cells array, which is sorted along axis when split
+    int begin;
+    int end;
+    uint64_t weight;
+    int axis;
+    int range;
+} ColorBox;
+
+typedef struct {
+    const uint32_t *counts;
+    const uint64_t (*sums)[3];
+} Histogram;
+
+unsigned char cell_channel(const Histogram *h, int cell, int axis) {
+    return h->sums[cell][axis] / h->counts[cell];
+}
+
+void measure_box(const Histogram *h, const int *cells, ColorBox *box) {
+    int lo[3] = {255, 255, 255};
+    int hi[3] = {0, 0, 0};
+    box->weight = 0;
+    for (int i = box->begin; i < box->end; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            int v = cell_channel(h, cells[i], axis);
+            lo[axis] = v < lo[axis] ? v : lo[axis];
+            hi[axis] = v > hi[axis] ? v : hi[axis];
+        }
+        box->weight += h->counts[cells[i]];
+    }
+    box->axis = 0;
+    for (int axis = 1; axis < 3; axis++) {
+        if (hi[axis] - lo[axis] > hi[box->axis] - lo[box->axis]) {
+            box->axis = axis;
+        }
+    }
+    box->range = hi[box->axis] - lo[box->axis];
+}
+
+const Histogram *SORT_HISTOGRAM;
+int SORT_AXIS;
+
+int compare_cells(const void *a, const void *b) {
+    int va = cell_channel(SORT_HISTOGRAM, *(const int *)a, SORT_AXIS);
+    int vb = cell_channel(SORT_HISTOGRAM, *(const int *)b, SORT_AXIS);
+    return va - vb;
+}
+
+// Median cut over the occupied histogram cells, returns the number of colors.
+int median_cut(const Histogram *h, Color *out, int max_colors) {
+    int *cells = malloc(CUBE_CELLS * sizeof(int));
+    int count = 0;
+    for (int cell = 0; cell < CUBE_CELLS; cell++) {
+        if (h->counts[cell] > 0) {
+            cells[count++] = cell;
+        }
+    }
+    ColorBox boxes[NUM_COLORS];
+    int box_count = 0;
+    if (count > 0) {
+        boxes[box_count] = (ColorBox){.begin = 0, .end = count};
+        measure_box(h, cells, &boxes[box_count++]);
+    }
+    while (box_count < max_colors) {
+        // the most populated box that still spans more than one color
+        int split = -1;
+        for (int i = 0; i < box_count; i++) {
+            if (boxes[i].range > 0 &&
+                (split < 0 || boxes[i].weight * boxes[i].range >
+                                  boxes[split].weight * boxes[split].range)) {
+                split = i;
+            }
+        }
+        if (split < 0) {
+            break;
+        }
+        ColorBox *box = &boxes[split];
+        SORT_HISTOGRAM = h;
+        SORT_AXIS = box->axis;
+        qsort(cells + box->begin, box->end - box->begin, sizeof(int),
+              compare_cells);
+        // weighted median, leaving at least one cell on each side
+        uint64_t half = box->weight / 2;
+        uint64_t seen = 0;
+        int middle = box->begin + 1;
+        for (int i = box->begin; i < box->end - 1; i++) {
+            seen += h->counts[cells[i]];
+            middle = i + 1;
+            if (seen >= half) {
+                break;
+            }
+        }
+        boxes[box_count] = (ColorBox){.begin = middle, .end = box->end};
+        box->end = middle;
+        measure_box(h, cells, box);
+        measure_box(h, cells, &boxes[box_count++]);
+    }
+    for (int i = 0; i < box_count; i++) {
+        uint64_t sum[3] = {0};
+        uint64_t weight = 0;
+        for (int j = boxes[i].begin; j < boxes[i].end; j++) {
+            for (int axis = 0; axis < 3; axis++) {
+                sum[axis] += h->sums[cells[j]][axis];
+            }
+            weight += h->counts[cells[j]];
+        }
+        out[i] = (Color){sum[0] / weight, sum[1] / weight, sum[2] / weight,
+                         255};
+    }
+    free(cells);
+    return box_count;
+}
+
+typedef struct {
+    const Histogram *h;
+    const Color *centers;
+    int center_count;
+    // per worker
+    uint64_t (*sums)[NUM_COLORS][4];
+} KMeans;
+
+void kmeans_assign(void *ctx, int begin, int end, int worker) {
+    KMeans *k = ctx;
+    uint64_t(*sums)[4] = k->sums[worker];
+    memset(sums, 0, sizeof(k->sums[worker]));
+    for (int cell = begin; cell < end; cell++) {
+        uint32_t n = k->h->counts[cell];
+        if (n == 0) {
+            continue;
+        }
+        Color c = {cell_channel(k->h, cell, 0), cell_channel(k->h, cell, 1),
+                   cell_channel(k->h, cell, 2), 255};
+        int best = 0;
+        for (int i = 1; i < k->center_count; i++) {
+            if (color_distance(c, k->centers[i]) <
+                color_distance(c, k->centers[best])) {
+                best = i;
+            }
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            sums[best][axis] += k->h->sums[cell][axis];
+        }
+        sums[best][3] += n;
+    }
+}
+
+// Refines median cut colors with a few weighted k-means passes.
+void kmeans_refine(const Histogram *h, Color *centers, int center_count) {
+    KMeans k = {
+        .h = h,
+        .centers = centers,
+        .center_count = center_count,
+        .sums = malloc(parallel_worker_count() * sizeof(*k.sums)),
+    };
+    for (int iteration = 0; iteration < KMEANS_ITERATIONS; iteration++) {
+        parallel_for(CUBE_CELLS, kmeans_assign, &k);
+        for (int i = 0; i < center_count; i++) {
+            uint64_t total[4] = {0};
+            for (int w = 0; w < parallel_worker_count(); w++) {
+                for (int axis = 0; axis < 4; axis++) {
+                    total[axis] += k.sums[w][i][axis];
+                }
+            }
+            if (total[3] > 0) {
+                centers[i] = (Color){total[0] / total[3], total[1] / total[3],
+                                     total[2] / total[3], 255};
+            }
+        }
+    }
+    free(k.sums);
+}
+
+void build_cube(void *ctx, int begin, int end, int worker) {
+    (void)worker;
+    SheetImport *import = ctx;
+    for (int cell = begin; cell < end; cell++) {
+        Color c = cube_color(cell);
+        int best = -1;
+        for (int i = 0; i < NUM_COLORS; i++) {
+            if (import->candidate[i] &&
+                (best < 0 || color_distance(c, import->palette[i]) <
+                                 color_distance(c, import->palette[best]))) {
+                best = i;
+            }
+        }
+        import->cube[cell] = best < 0 ? TRANSPARENT_INDEX : best;
+    }
+}
+
+unsigned char clamp_channel(int value) {
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+unsigned char cube_lookup(const SheetImport *import, int r, int g, int b) {
+    Color c = {clamp_channel(r), clamp_channel(g), clamp_channel(b), 255};
+    return import->cube[cube_cell(c)];
+}
+
+// Maps one tile, returns false if it has no opaque pixel. Each tile is
+// dithered on its own, so tiles can be mapped in any order. The modes have
+// their own loops to keep the plain lookup free of dithering work.
+bool map_tile(const SheetImport *import, int tile, unsigned char *out) {
+    bool opaque = false;
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        const Color *row = tile_row(import, tile, y);
+        // built in a register, stores through out could alias everything
+        uint64_t word = 0;
+        for (int x = 0; x < SPRITE_SIZE; x++) {
+            unsigned char index = TRANSPARENT_INDEX;
+            if (row[x].a >= IMPORT_ALPHA_CUTOFF) {
+                opaque = true;
+                index = import->cube[cube_cell(row[x])];
+            }
+            word |= (uint64_t)index << (4 * x);
+        }
+        store_row(out + y * ROW_BYTES, word);
+    }
+    return opaque;
+}
+
+bool map_tile_ordered(const SheetImport *import, int tile,
+                      unsigned char *out) {
+    bool opaque = false;
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        const Color *row = tile_row(import, tile, y);
+        // built in a register, stores through out could alias everything
+        uint64_t word = 0;
+        for (int x = 0; x < SPRITE_SIZE; x++) {
+            Color c = row[x];
+            unsigned char index = TRANSPARENT_INDEX;
+            if (c.a >= IMPORT_ALPHA_CUTOFF) {
+                opaque = true;
+                int threshold = BAYER4[y & 3][x & 3] * 2 + 1;
+                int offset = threshold * BAYER_SPREAD / 32 - BAYER_SPREAD / 2;
+                index = cube_lookup(import, c.r + offset, c.g + offset,
+                                    c.b + offset);
+            }
+            word |= (uint64_t)index << (4 * x);
+        }
+        store_row(out + y * ROW_BYTES, word);
+    }
+    return opaque;
+}
+
+// Tiles dithered side by side by map_tiles_diffusion. Each pixel depends on
+// the error of the one before it, so a single tile is one long dependency
+// chain. Interleaving independent tiles lets their lookups overlap.
+enum { DIFFUSION_LANES = 4 };
+
+// Floyd-Steinberg with the error kept in 16ths, for count <= DIFFUSION_LANES
+// tiles starting at first. The errors of the last two pixels stay in locals,
+// so each entry of the buffer for the row below is written once, when no
+// later pixel adds to it anymore.
+static inline void map_tiles_diffusion(SheetImport *import, int first,
+                                       int count) {
+    // one entry of padding on the left
+    int error[DIFFUSION_LANES][2][SPRITE_SIZE + 1][3] = {0};
+    bool opaque[DIFFUSION_LANES] = {0};
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        const Color *rows[DIFFUSION_LANES];
+        uint64_t words[DIFFUSION_LANES] = {0};
+        // error of the pixel before and the one before that
+        int e1[DIFFUSION_LANES][3] = {0};
+        int e2[DIFFUSION_LANES][3] = {0};
+        for (int lane = 0; lane < count; lane++) {
+            rows[lane] = tile_row(import, first + lane, y);
+        }
+        for (int x = 0; x < SPRITE_SIZE; x++) {
+            for (int lane = 0; lane < count; lane++) {
+                int(*here)[3] = error[lane][y & 1];
+                int(*below)[3] = error[lane][(y + 1) & 1];
+                Color c = rows[lane][x];
+                int e[3] = {0};
+                unsigned char index = TRANSPARENT_INDEX;
+                if (c.a >= IMPORT_ALPHA_CUTOFF) {
+                    opaque[lane] = true;
+                    Color want = {
+                        clamp_channel(
+                            c.r + ((here[x + 1][0] + e1[lane][0] * 7) >> 4)),
+                        clamp_channel(
+                            c.g + ((here[x + 1][1] + e1[lane][1] * 7) >> 4)),
+                        clamp_channel(
+                            c.b + ((here[x + 1][2] + e1[lane][2] * 7) >> 4)),
+                        255,
+                    };
+                    index = import->cube[cube_cell(want)];
+                    Color got = import->palette[index];
+                    e[0] = want.r - got.r;
+                    e[1] = want.g - got.g;
+                    e[2] = want.b - got.b;
+                }
+                // below left of this pixel is complete now
+                for (int k = 0; k < 3; k++) {
+                    below[x][k] = e2[lane][k] + e1[lane][k] * 5 + e[k] * 3;
+                    e2[lane][k] = e1[lane][k];
+                    e1[lane][k] = e[k];
+                }
+                words[lane] |= (uint64_t)index << (4 * x);
+            }
+        }
+        for (int lane = 0; lane < count; lane++) {
+            int(*below)[3] = error[lane][(y + 1) & 1];
+            for (int k = 0; k < 3; k++) {
+                below[SPRITE_SIZE][k] = e2[lane][k] + e1[lane][k] * 5;
+            }
+            unsigned char *out =
+                import->tiles + (size_t)(first + lane) * SPRITE_BYTES;
+            store_row(out + y * ROW_BYTES, words[lane]);
+        }
+    }
+    for (int lane = 0; lane < count; lane++) {
+        import->keep[first + lane] = opaque[lane];
+    }
+}
+
+void map_tiles(void *ctx, int begin, int end, int worker) {
+    (void)worker;
+    SheetImport *import = ctx;
+    if (import->dither == DITHER_DIFFUSION) {
+        // full groups get a constant lane count the compiler can unroll
+        int tile = begin;
+        for (; tile + DIFFUSION_LANES <= end; tile += DIFFUSION_LANES) {
+            map_tiles_diffusion(import, tile, DIFFUSION_LANES);
+        }
+        if (tile < end) {
+            map_tiles_diffusion(import, tile, end - tile);
+        }
+        return;
+    }
+    for (int tile = begin; tile < end; tile++) {
+        unsigned char *out = import->tiles + (size_t)tile * SPRITE_BYTES;
+        // empty cells of the sheet are not imported
+        if (import->dither == DITHER_ORDERED) {
+            import->keep[tile] = map_tile_ordered(import, tile, out);
+        } else {
+            import->keep[tile] = map_tile(import, tile, out);
+        }
+    }
+}
+
+// Builds out from the histogram, keeping TRANSPARENT_INDEX for transparent
+// pixels if the sheet has any.
+void build_palette(SheetImport *import, bool has_transparent, Color *out) {
+    int workers = parallel_worker_count();
+    for (int w = 1; w < workers; w++) {
+        uint32_t *counts = import->counts + (size_t)w * CUBE_CELLS;
+        uint64_t(*sums)[3] = import->sums + (size_t)w * CUBE_CELLS;
+        for (int cell = 0; cell < CUBE_CELLS; cell++) {
+            import->counts[cell] += counts[cell];
+            for (int axis = 0; axis < 3; axis++) {
+                import->sums[cell][axis] += sums[cell][axis];
+            }
+        }
+    }
+    Histogram h = {.counts = import->counts, .sums = import->sums};
+    Color colors[NUM_COLORS];
+    int max_colors = has_transparent ? NUM_COLORS - 1 : NUM_COLORS;
+    int count = median_cut(&h, colors, max_colors);
+    kmeans_refine(&h, colors, count);
+
+    int next = 0;
+    for (int i = 0; i < NUM_COLORS; i++) {
+        if (has_transparent && i == TRANSPARENT_INDEX) {
+            out[i] = BLANK;
+        } else if (next < count) {
+            out[i] = colors[next++];
+        } else {
+            out[i] = BLACK;
+        }
+    }
+}
+
+// Appends the non-empty tiles of a PNG sheet to SPRITES, returns the number
+// of imported sprites or -1. A built palette goes into a new palette slot,
+// unless the bank already has the same one, so the existing sprites keep
+// their colors.
+int import_sheet(const char *path, ImportPalette palette,
+                 ImportDither dither) {
+    double start = GetTime();
+    Image image = LoadImage(path);
+    if (image.data == NULL) {
+        TraceLog(LOG_ERROR, "Error loading sheet: %s", path);
+        return -1;
+    }
+    ImageFormat(&image, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    if (image.width % SPRITE_SIZE != 0 || image.height % SPRITE_SIZE != 0) {
+        TraceLog(LOG_WARNING, "%s: partial tiles at the edges are skipped",
+                 path);
+    }
+
+    int workers = parallel_worker_count();
+    SheetImport *import = calloc(1, sizeof(SheetImport));
+    import->pixels = image.data;
+    import->dither = dither;
+    import->width = image.width;
+    import->columns = image.width / SPRITE_SIZE;
+    import->tile_count = import->columns * (image.height / SPRITE_SIZE);
+    import->tiles = malloc((size_t)import->tile_count * SPRITE_BYTES);
+    import->keep = malloc(import->tile_count * sizeof(bool));
+    import->has_transparent = calloc(workers, sizeof(bool));
+    if (palette == IMPORT_BUILD_PALETTE) {
+        size_t cells = (size_t)workers * CUBE_CELLS;
+        import->counts = calloc(cells, sizeof(uint32_t));
+        import->sums = calloc(cells, sizeof(*import->sums));
+    }
+    int result = -1;
+    int sprite_palette = 0;
+    if (import->tiles == NULL || import->keep == NULL ||
+        import->has_transparent == NULL ||
+        (palette == IMPORT_BUILD_PALETTE &&
+         (import->counts == NULL || import->sums == NULL))) {
+        TraceLog(LOG_ERROR, "could not allocate import of %s", path);
+        goto cleanup;
+    }
+
+    if (palette == IMPORT_BUILD_PALETTE) {
+        parallel_for(import->tile_count, count_colors, import);
+        bool has_transparent = false;
+        for (int w = 0; w < workers; w++) {
+            has_transparent |= import->has_transparent[w];
+        }
+        build_palette(import, has_transparent, import->palette);
+        // reuse the same palette, e.g. when the sheet is imported again
+        while (sprite_palette < PALETTE_COUNT &&
+               memcmp(PALETTES[sprite_palette], import->palette,
+                      sizeof(PALETTES[0])) != 0) {
+            sprite_palette++;
+        }
+        if (sprite_palette == MAX_PALETTES) {
+            TraceLog(LOG_ERROR, "%s: the bank already has %d palettes", path,
+                     MAX_PALETTES);
+            goto cleanup;
+        }
+    } else {
+        memcpy(import->palette, COLORS, NUM_COLORS * sizeof(Color));
+    }
+    for (int i = 0; i < NUM_COLORS; i++) {
+        import->candidate[i] = i != TRANSPARENT_INDEX &&
+                               import->palette[i].a >= IMPORT_ALPHA_CUTOFF;
+    }
+    parallel_for(CUBE_CELLS, build_cube, import);
+    parallel_for(import->tile_count, map_tiles, import);
+
+    UndoRecord record = {.kind = UNDO_INSERT};
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    int stem = strcspn(base, ".");
+    result = 0;
+    for (int tile = 0; tile < import->tile_count; tile++) {
+        if (!import->keep[tile]) {
+            continue;
+        }
+        char name[MAX_NAME_LEN];
+        snprintf(name, MAX_NAME_LEN, "%.*s_%d", stem, base, tile);
+        Sprite sprite = {
+            .name = strdup(name),
+            .pixels = malloc(SPRITE_BYTES),
+            .id = NEXT_SPRITE_ID++,
+            .palette = sprite_palette,
+        };
+        if (sprite.name == NULL || sprite.pixels == NULL) {
+            TraceLog(LOG_FATAL, "could not allocate imported sprite");
+            abort();
+        }
+        memcpy(sprite.pixels, import->tiles + (size_t)tile * SPRITE_BYTES,
+               SPRITE_BYTES);
+        shm_mark_moved(SPRITES.count);
+        da_append(&SPRITES, sprite);
+        UndoEntry entry = {.id = sprite.id};
+        da_append(&record, entry);
+        result++;
+    }
+    // an empty sheet does not use up a palette slot
+    if (sprite_palette == PALETTE_COUNT && result > 0) {
+        memcpy(PALETTES[PALETTE_COUNT++], import->palette,
+               NUM_COLORS * sizeof(Color));
+        PALETTE_VERSION++;
+        record.palette = sprite_palette;
+    }
+    push_undo(&record);
+    TraceLog(LOG_INFO, "imported %d of %d tiles from %s in %.1f ms", result,
+             import->tile_count, path, (GetTime() - start) * 1000);
+
+cleanup:
+    free(import->tiles);
+    free(import->keep);
+    free(import->has_transparent);
+    free(import->counts);
+    free(import->sums);
+    free(import);
+    UnloadImage(image);
+    return result;
+}
+
+void import_sheet_popup() {
+    char *path = string_popup("Import PNG sheet", "", 256);
+    if (path == NULL) {
+        return;
+    }
+    char *options[] = {"Match palette", "Build palette"};
+    int palette = button_list_popup("Palette for the imported tiles?", 2,
+                                    options, IMPORT_MATCH_PALETTE);
+    char *dither_options[] = {"None", "Ordered", "Diffusion"};
+    int dither = palette < 0 ? -1
+                             : button_list_popup("Dithering?", 3,
+                                                 dither_options, DITHER_NONE);
+    if (dither >= 0) {
+        import_sheet(path, palette, dither);
+    }
+    free(path);
+}
+
+// PNG export straight from the 4bpp bitmaps: the images are 4 bit indexed
+// with the palette of the sprites as PLTE and its alpha as tRNS. Sprites in
+// different palettes make an 8 bit image with all palettes one after the
+// other, so pixel values are palette << 4 | color. Sheets are compressed in
+// bands of rows on all cores. Each band is a raw deflate stream ending in a
+// sync flush, so the bands concatenate into one zlib stream.
+int PNG_LEVEL = Z_DEFAULT_COMPRESSION;
+// sheet rows per band, a multiple of SPRITE_SIZE
+const int PNG_BAND_ROWS = 4 * SPRITE_SIZE;
+
+typedef enum {
+    MANIFEST_JSON,
+    MANIFEST_CSV,
+} ManifestFormat;
+
+typedef struct {
+    const int *indices;
+    int count;
+    int columns;
+    // a ready made image in PNG nibble order to encode instead of sprites
+    const unsigned char *image;
+    int width;
+    int height;
+    // PLTE of a 4 bit image, -1 for an 8 bit image with all palettes
+    int palette;
+    int band_count;
+    // compressed bands and the adler32 of their raw scanlines
+    String_Builder *bands;
+    uLong *adlers;
+    size_t *raw_sizes;
+    // set by whichever band worker fails
+    atomic_bool failed;
+} PngEncode;
+
+const Sprite *sheet_sprite(const PngEncode *png, int k) {
+    if (k >= png->count) {
+        return NULL;
+    }
+    return &SPRITES.items[png->indices ? png->indices[k] : k];
+}
+
+// palette all sprites at indices (all if NULL) use, or -1 if they differ
+int common_palette(const int *indices, int count) {
+    int palette = 0;
+    for (int k = 0; k < count; k++) {
+        int p = SPRITES.items[indices ? indices[k] : k].palette;
+        if (k > 0 && p != palette) {
+            return -1;
+        }
+        palette = p;
+    }
+    return palette;
+}
+
+// bytes of one row of an image width pixels wide, without the filter byte
+size_t png_stride(const PngEncode *png) {
+    return png->palette < 0 ? png->width : (png->width + 1) / 2;
+}
+
+// the file keeps the left pixel in the low nibble, PNG in the high one
+uint64_t png_row(uint64_t row) {
+    return (row >> 4 & 0x0F0F0F0F0F0F0F0FULL) |
+           (row & 0x0F0F0F0F0F0F0F0FULL) << 4;
+}
+
+void encode_band(PngEncode *png, int band) {
+    int first = band * PNG_BAND_ROWS;
+    int rows = png->height - first < PNG_BAND_ROWS ? png->height - first
+                                                   : PNG_BAND_ROWS;
+    size_t stride = 1 + png_stride(png);
+    size_t raw_size = stride * rows;
+    unsigned char *raw = malloc(raw_size);
+    uint64_t empty = NIBBLE_ONES * TRANSPARENT_INDEX;
+    for (int r = 0; r < rows; r++) {
+        int y = first + r;
+        unsigned char *line = raw + r * stride;
+        // no filter, which suits indexed images best
+        line[0] = 0;
+        if (png->image) {
+            memcpy(line + 1, png->image + y * (stride - 1), stride - 1);
+            continue;
+        }
+        for (int column = 0; column < png->columns; column++) {
+            const Sprite *sprite =
+                sheet_sprite(png, y / SPRITE_SIZE * png->columns + column);
+            uint64_t word =
+                sprite ? load_row(sprite->pixels + y % SPRITE_SIZE * ROW_BYTES)
+                       : empty;
+            if (png->palette >= 0) {
+                store_row(line + 1 + column * ROW_BYTES, png_row(word));
+                continue;
+            }
+            unsigned char *out = line + 1 + column * SPRITE_SIZE;
+            unsigned char high = sprite ? sprite->palette << 4 : 0;
+            for (int x = 0; x < SPRITE_SIZE; x++, word >>= 4) {
+                out[x] = high | (word & 0xF);
+            }
+        }
+    }
+
+    z_stream stream = {0};
+    String_Builder *out = &png->bands[band];
+    bool last = band == png->band_count - 1;
+    if (deflateInit2(&stream, PNG_LEVEL, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        png->failed = true;
+        free(raw);
+        return;
+    }
+    size_t bound = deflateBound(&stream, raw_size) + 16;
+    da_reserve(out, bound);
+    stream.next_in = raw;
+    stream.avail_in = raw_size;
+    stream.next_out = (unsigned char *)out->items;
+    stream.avail_out = bound;
+    int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (status != (last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0) {
+        png->failed = true;
+    }
+    out->count = bound - stream.avail_out;
+    deflateEnd(&stream);
+    png->adlers[band] = adler32(adler32(0, NULL, 0), raw, raw_size);
+    png->raw_sizes[band] = raw_size;
+    free(raw);
+}
+
+void encode_bands(void *ctx, int begin, int end, int worker) {
+    (void)worker;
+    for (int band = begin; band < end; band++) {
+        encode_band(ctx, band);
+    }
+}
+
+void append_be32(String_Builder *out, uint32_t value) {
+    unsigned char bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+    sb_append_buf(out, bytes, 4);
+}
+
+void png_chunk(String_Builder *out, const char *type, const void *data,
+               size_t size) {
+    append_be32(out, size);
+    size_t start = out->count;
+    sb_append_buf(out, type, 4);
+    sb_append_buf(out, data, size);
+    append_be32(out, crc32(0, (unsigned char *)out->items + start, size + 4));
+}
+
+// Bands are spread over cores if parallel is set, callers encoding many small
+// images in parallel already keep the cores busy.
+bool finish_png(String_Builder *out, PngEncode png, bool parallel) {
+    png.band_count = (png.height + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+    png.bands = calloc(png.band_count, sizeof(String_Builder));
+    png.adlers = calloc(png.band_count, sizeof(uLong));
+    png.raw_sizes = calloc(png.band_count, sizeof(size_t));
+    if (parallel) {
+        parallel_for(png.band_count, encode_bands, &png);
+    } else {
+        encode_bands(&png, 0, png.band_count, 0);
+    }
+
+    if (!png.failed) {
+        sb_append_buf(out, "\x89PNG\r\n\x1a\n", 8);
+        unsigned char header[13] = {
+            png.width >> 24, png.width >> 16, png.width >> 8, png.width,
+            png.height >> 24, png.height >> 16, png.height >> 8, png.height,
+            // indexed, no interlacing
+            png.palette < 0 ? 8 : 4, 3, 0, 0, 0,
+        };
+        png_chunk(out, "IHDR", header, sizeof(header));
+        const Color *colors =
+            PALETTES[png.palette < 0 ? 0 : png.palette];
+        int entries =
+            png.palette < 0 ? PALETTE_COUNT * NUM_COLORS : NUM_COLORS;
+        unsigned char palette[MAX_PALETTES * NUM_COLORS * 3];
+        unsigned char alpha[MAX_PALETTES * NUM_COLORS];
+        for (int i = 0; i < entries; i++) {
+            palette[3 * i] = colors[i].r;
+            palette[3 * i + 1] = colors[i].g;
+            palette[3 * i + 2] = colors[i].b;
+            alpha[i] = colors[i].a;
+        }
+        png_chunk(out, "PLTE", palette, 3 * entries);
+        png_chunk(out, "tRNS", alpha, entries);
+
+        // zlib header for a 32k window, the bands, and the combined checksum
+        String_Builder data = {0};
+        sb_append_buf(&data, "\x78\x9c", 2);
+        uLong adler = adler32(0, NULL, 0);
+        for (int band = 0; band < png.band_count; band++) {
+            sb_append_buf(&data, png.bands[band].items, png.bands[band].count);
+            adler = adler32_combine(adler, png.adlers[band],
+                                    png.raw_sizes[band]);
+        }
+        append_be32(&data, adler);
+        png_chunk(out, "IDAT", data.items, data.count);
+        png_chunk(out, "IEND", NULL, 0);
+        sb_free(data);
+    }
+
+    for (int band = 0; band < png.band_count; band++) {
+        sb_free(png.bands[band]);
+    }
+    free(png.bands);
+    free(png.adlers);
+    free(png.raw_sizes);
+    return !png.failed;
+}
+
+// Encodes the sprites at indices (all if NULL) as a sheet with the given
+// number of columns.
+bool encode_png(String_Builder *out, const int *indices, int count,
+                int columns, bool parallel) {
+    int rows = (count + columns - 1) / columns;
+    PngEncode png = {
+        .indices = indices,
+        .count = count,
+        .columns = columns,
+        .width = columns * SPRITE_SIZE,
+        .height = rows * SPRITE_SIZE,
+        .palette = common_palette(indices, count),
+    };
+    return finish_png(out, png, parallel);
+}
+
+// image holds (width + 1) / 2 bytes per row, the left pixel in the high
+// nibble, in palette, or for a palette of -1 one palette << 4 | color byte
+// per pixel
+bool encode_png_image(String_Builder *out, const unsigned char *image,
+                      int width, int height, int palette) {
+    PngEncode png = {
+        .image = image,
+        .width = width,
+        .height = height,
+        .palette = palette,
+    };
+    return finish_png(out, png, true);
+}
+
+void append_quoted(String_Builder *out, const char *text, bool json) {
+    sb_append_cstr(out, "\"");
+    for (const char *c = text; *c; c++) {
+        if (*c == '"') {
+            sb_append_cstr(out, json ? "\\\"" : "\"\"");
+        } else if (json && *c == '\\') {
+            sb_append_cstr(out, "\\\\");
+        } else if (json && (unsigned char)*c < 0x20) {
+            sb_append_cstr(out, temp_sprintf("\\u%04x", *c));
+        } else {
+            sb_append_buf(out, c, 1);
+        }
+    }
+    sb_append_cstr(out, "\"");
+}
+
+// length of path without the extension of its last component
+int path_stem(const char *path) {
+    const char *name = strrchr(path, '/');
+    const char *dot = strrchr(path, '.');
+    return dot && (name == NULL || dot > name + 1) && dot != path
+               ? dot - path
+               : (int)strlen(path);
+}
+
+// Writes the sprites at indices (all if NULL) as one PNG sheet, plus a
+// manifest with the position of every sprite next to it, with the extension
+// of path replaced by .json or .csv.
+int export_png_sheet(const char *path, const int *indices, int count,
+                     ManifestFormat format) {
+    double start = GetTime();
+    if (count == 0) {
+        return 0;
+    }
+    int columns = ceil(sqrt(count));
+    String_Builder png = {0};
+    String_Builder manifest = {0};
+    int result = 0;
+    if (!encode_png(&png, indices, count, columns, true)) {
+        TraceLog(LOG_ERROR, "Error encoding %s", path);
+        result = -1;
+        goto cleanup;
+    }
+    if (!write_entire_file(path, png.items, png.count)) {
+        result = -1;
+        goto cleanup;
+    }
+
+    const char *image = strrchr(path, '/');
+    image = image ? image + 1 : path;
+    bool json = format == MANIFEST_JSON;
+    if (json) {
+        sb_append_cstr(&manifest, "{\"image\": ");
+        append_quoted(&manifest, image, true);
+        sb_append_cstr(&manifest,
+                       temp_sprintf(", \"width\": %d, \"height\": %d, "
+                                    "\"sprites\": [\n",
+                                    columns * SPRITE_SIZE,
+                                    (count + columns - 1) / columns *
+                                        SPRITE_SIZE));
+    } else {
+        sb_append_cstr(&manifest, "name,x,y,w,h\n");
+    }
+    for (int k = 0; k < count; k++) {
+        const Sprite *sprite = &SPRITES.items[indices ? indices[k] : k];
+        int x = k % columns * SPRITE_SIZE;
+        int y = k / columns * SPRITE_SIZE;
+        if (json) {
+            sb_append_cstr(&manifest, "  {\"name\": ");
+        }
+        append_quoted(&manifest, sprite->name, json);
+        size_t mark = temp_save();
+        sb_append_cstr(&manifest,
+                       json ? temp_sprintf(", \"x\": %d, \"y\": %d, \"w\": %d, "
+                                           "\"h\": %d}%s\n",
+                                           x, y, SPRITE_SIZE, SPRITE_SIZE,
+                                           k + 1 < count ? "," : "")
+                            : temp_sprintf(",%d,%d,%d,%d\n", x, y,
+                                           SPRITE_SIZE, SPRITE_SIZE));
+        temp_rewind(mark);
+    }
+    if (json) {
+        sb_append_cstr(&manifest, "]}\n");
+    }
+    const char *manifest_path =
+        temp_sprintf("%.*s.%s", path_stem(path), path, json ? "json" : "csv");
+    if (!write_entire_file(manifest_path, manifest.items, manifest.count)) {
+        result = -1;
+        goto cleanup;
+    }
+    TraceLog(LOG_INFO, "exported %d sprites to %s in %.1f ms", count, path,
+             (GetTime() - start) * 1000);
+
+cleanup:
+    sb_free(png);
+    sb_free(manifest);
+    temp_reset();
+    return result;
+}
+
+typedef struct {
+    const char *dir;
+    const int *indices;
+    // file name of each sprite, without the directory
+    char **names;
+    // set by whichever worker fails
+    atomic_bool failed;
+} PngFiles;
+
+void encode_files(void *ctx, int begin, int end, int worker) {
+    (void)worker;
+    PngFiles *files = ctx;
+    String_Builder png = {0};
+    char path[4096];
+    for (int k = begin; k < end; k++) {
+        int index = files->indices ? files->indices[k] : k;
+        png.count = 0;
+        snprintf(path, sizeof(path), "%s/%s", files->dir, files->names[k]);
+        if (!encode_png(&png, &index, 1, 1, false) ||
+            !write_entire_file(path, png.items, png.count)) {
+            files->failed = true;
+        }
+    }
+    sb_free(png);
+}
+
+// Writes every sprite at indices (all if NULL) to its own PNG in dir, named
+// after the sprite. Names that are taken already get the position appended.
+int export_png_files(const char *dir, const int *indices, int count) {
+    double start = GetTime();
+    if (!mkdir_if_not_exists(dir)) {
+        return -1;
+    }
+    PngFiles files = {
+        .dir = dir,
+        .indices = indices,
+        .names = calloc(count, sizeof(char *)),
+    };
+    // open addressing over the names handed out so far
+    int table_size = 1;
+    while (table_size < 2 * count) {
+        table_size *= 2;
+    }
+    char **taken = calloc(table_size, sizeof(char *));
+    for (int k = 0; k < count; k++) {
+        const char *name = SPRITES.items[indices ? indices[k] : k].name;
+        char file[MAX_NAME_LEN + 16];
+        // keep file names to one path component
+        int len = snprintf(file, sizeof(file), "%s", name[0] ? name : "_");
+        for (int i = 0; i < len; i++) {
+            if (file[i] == '/' || file[i] == '\\') {
+                file[i] = '_';
+            }
+        }
+        uint32_t slot = text_hash(file) & (table_size - 1);
+        bool duplicate = false;
+        while (taken[slot] != NULL) {
+            if (strcmp(taken[slot], file) == 0) {
+                duplicate = true;
+                break;
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (!duplicate) {
+            taken[slot] = strdup(file);
+        }
+        files.names[k] = duplicate ? strdup(temp_sprintf("%s_%d.png", file, k))
+                                   : strdup(temp_sprintf("%s.png", file));
+        temp_reset();
+    }
+
+    parallel_for(count, encode_files, &files);
+    if (files.failed) {
+        TraceLog(LOG_ERROR, "Error exporting sprites to %s", dir);
+    } else {
+        TraceLog(LOG_INFO, "exported %d sprites to %s in %.1f ms", count, dir,
+                 (GetTime() - start) * 1000);
+    }
+
+    for (int i = 0; i < table_size; i++) {
+        free(taken[i]);
+    }
+    free(taken);
+    for (int k = 0; k < count; k++) {
+        free(files.names[k]);
+    }
+    free(files.names);
+    return files.failed ? -1 : 0;
+}
+
+// A path ending in .png becomes one sheet with a JSON manifest, anything
+// else a directory with one PNG per sprite.
+int export_png(const char *path, const int *indices, int count) {
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".png") == 0) {
+        return export_png_sheet(path, indices, count, MANIFEST_JSON);
+    }
+    return export_png_files(path, indices, count);
+}
+
+void export_selected_png() {
+    char *path = string_popup("Export PNG sheet (.png) or folder", "", 256);
+    if (path == NULL) {
+        return;
+    }
+    IntList indices = {0};
+    selected_indices(&indices);
+    export_png(path, indices.items, indices.count);
+    da_free(indices);
+    free(path);
+}
+
+// Atlas export for games. Every sprite is trimmed to the box around its
+// opaque pixels, sprites with identical trimmed images share one spot, and
+// the boxes are packed with a skyline packer into power of two pages. The
+// manifest has the page and box of each sprite and the offset of the box in
+// the sprite, so it can still be drawn from the original origin.
+int ATLAS_PAGE_SIZE = 2048;
+// transparent pixels between packed boxes, against bleeding when filtering
+int ATLAS_PADDING = 0;
+
+typedef struct {
+    // box of the opaque pixels, empty for fully transparent sprites
+    int x;
+    int y;
+    int width;
+    int height;
+    uint32_t hash;
+    // entry packed in place of this one, the entry itself unless it is a
+    // duplicate
+    int original;
+    int page;
+    int page_x;
+    int page_y;
+} AtlasEntry;
+
+void trim_sprite(const unsigned char *pixels, AtlasEntry *entry) {
+    // the opaque masks of all rows OR-ed together give the columns
+    uint64_t columns = 0;
+    int top = SPRITE_SIZE;
+    int bottom = -1;
+    for (int y = 0; y < SPRITE_SIZE; y++) {
+        uint64_t mask = opaque_mask(load_row(pixels + y * ROW_BYTES),
+                                    TRANSPARENT_INDEX);
+        if (mask != 0) {
+            top = top < y ? top : y;
+            bottom = y;
+            columns |= mask;
+        }
+    }
+    if (columns == 0) {
+        *entry = (AtlasEntry){0};
+        return;
+    }
+    entry->x = __builtin_ctzll(columns) / 4;
+    entry->width = (63 - __builtin_clzll(columns)) / 4 + 1 - entry->x;
+    entry->y = top;
+    entry->height = bottom - top + 1;
+}
+
+// row r of the trimmed image, its left pixel in the low nibble
+uint64_t trimmed_row(const unsigned char *pixels, const AtlasEntry *entry,
+                     int r) {
+    uint64_t row =
+        load_row(pixels + (entry->y + r) * ROW_BYTES) >> 4 * entry->x;
+    return entry->width == SPRITE_SIZE
+               ? row
+               : row & ((1ULL << 4 * entry->width) - 1);
+}
+
+uint32_t trimmed_hash(const unsigned char *pixels, const AtlasEntry *entry) {
+    // FNV-1a over whole rows
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (entry->width << 8 | entry->height);
+    for (int r = 0; r < entry->height; r++) {
+        hash = (hash ^ trimmed_row(pixels, entry, r)) * 0x100000001b3ULL;
+    }
+    return hash ^ hash >> 32;
+}
+
+bool same_trimmed(const unsigned char *a_pixels, const AtlasEntry *a,
+                  const unsigned char *b_pixels, const AtlasEntry *b) {
+    if (a->width != b->width || a->height != b->height) {
+        return false;
+    }
+    for (int r = 0; r < a->height; r++) {
+        if (trimmed_row(a_pixels, a, r) != trimmed_row(b_pixels, b, r)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    int x;
+    int y;
+    int width;
+} SkylineSegment;
+
+// the top outline of what is packed so far, segments from left to right
+typedef struct {
+    SkylineSegment *items;
+    int count;
+    int capacity;
+    int width;
+    int height;
+} Skyline;
+
+void skyline_reset(Skyline *sky, int width, int height) {
+    sky->count = 0;
+    sky->width = width;
+    sky->height = height;
+    da_append(sky, ((SkylineSegment){0, 0, width}));
+}
+
+// Places a box at the lowest spot, ties go to the narrowest segment to leave
+// the smallest gaps.
+bool skyline_insert(Skyline *sky, int width, int height, int *x, int *y) {
+    int best = -1;
+    int best_y = INT_MAX;
+    int best_width = INT_MAX;
+    for (int i = 0; i < sky->count; i++) {
+        int left = sky->items[i].x;
+        if (left + width > sky->width) {
+            break;
+        }
+        int top = 0;
+        for (int j = i; j < sky->count && sky->items[j].x < left + width;
+             j++) {
+            top = sky->items[j].y > top ? sky->items[j].y : top;
+        }
+        if (top + height <= sky->height &&
+            (top < best_y ||
+             (top == best_y && sky->items[i].width < best_width))) {
+            best = i;
+            best_y = top;
+            best_width = sky->items[i].width;
+        }
+    }
+    if (best < 0) {
+        return false;
+    }
+    *x = sky->items[best].x;
+    *y = best_y;
+
+    SkylineSegment segment = {*x, best_y + height, width};
+    da_append(sky, segment);
+    memmove(&sky->items[best + 1], &sky->items[best],
+            (sky->count - best - 1) * sizeof(SkylineSegment));
+    sky->items[best] = segment;
+    // cut the segments below the new one
+    int right = segment.x + segment.width;
+    while (best + 1 < sky->count && sky->items[best + 1].x < right) {
+        SkylineSegment *next = &sky->items[best + 1];
+        int overlap = right - next->x;
+        if (overlap < next->width) {
+            next->x += overlap;
+            next->width -= overlap;
+            break;
+        }
+        memmove(next, next + 1,
+                (sky->count - best - 2) * sizeof(SkylineSegment));
+        sky->count--;
+    }
+    // merge neighbours of the same height
+    int merged = 0;
+    for (int i = 1; i < sky->count; i++) {
+        if (sky->items[i].y == sky->items[merged].y) {
+            sky->items[merged].width += sky->items[i].width;
+        } else {
+            sky->items[++merged] = sky->items[i];
+        }
+    }
+    sky->count = merged + 1;
+    return true;
+}
+
+typedef struct {
+    int width;
+    int height;
+} AtlasPage;
+
+typedef struct {
+    AtlasPage *items;
+    int count;
+    int capacity;
+} AtlasPages;
+
+// tallest first, which keeps the skyline flat
+const AtlasEntry *SORT_ENTRIES = NULL;
+int compare_boxes(const void *a, const void *b) {
+    const AtlasEntry *ea = &SORT_ENTRIES[*(const int *)a];
+    const AtlasEntry *eb = &SORT_ENTRIES[*(const int *)b];
+    if (ea->height != eb->height) {
+        return eb->height - ea->height;
+    }
+    if (ea->width != eb->width) {
+        return eb->width - ea->width;
+    }
+    return *(const int *)a - *(const int *)b;
+}
+
+// Packs order[first..] into a width x height page until a box does not fit.
+// Returns how many were placed.
+int pack_page(Skyline *sky, AtlasEntry *entries, const int *order,
+              int first, int count, int page, int width, int height) {
+    // the padding after the last box in a row or column may hang outside
+    skyline_reset(sky, width + ATLAS_PADDING, height + ATLAS_PADDING);
+    int k = first;
+    for (; k < count; k++) {
+        AtlasEntry *entry = &entries[order[k]];
+        if (!skyline_insert(sky, entry->width + ATLAS_PADDING,
+                            entry->height + ATLAS_PADDING, &entry->page_x,
+                            &entry->page_y)) {
+            break;
+        }
+        entry->page = page;
+    }
+    return k - first;
+}
+
+// Fills pages with the boxes at order, then shrinks every page to the
+// smallest power of two size its boxes still fit into.
+void pack_atlas(AtlasEntry *entries, const int *order, int count,
+                AtlasPages *pages) {
+    Skyline sky = {0};
+    int size = ATLAS_PAGE_SIZE;
+    for (int first = 0; first < count;) {
+        int page = pages->count;
+        int placed = pack_page(&sky, entries, order, first, count, page, size,
+                               size);
+        int area = 0;
+        for (int k = first; k < first + placed; k++) {
+            const AtlasEntry *entry = &entries[order[k]];
+            area += (entry->width + ATLAS_PADDING) *
+                    (entry->height + ATLAS_PADDING);
+        }
+        // smallest areas first, the squarest shape of each area first
+        AtlasPage fit = {size, size};
+        for (int64_t target = 1; target < (int64_t)size * size; target *= 2) {
+            if (target < area) {
+                continue;
+            }
+            int width = 1;
+            while ((int64_t)width * width < target) {
+                width *= 2;
+            }
+            bool found = false;
+            for (; width <= size && target / width >= 1; width *= 2) {
+                int height = target / width;
+                if (height > size) {
+                    continue;
+                }
+                if (pack_page(&sky, entries, order, first, first + placed,
+                              page, width, height) == placed) {
+                    fit = (AtlasPage){width, height};
+                    found = true;
+                    break;
+                }
+            }
+            if (found) {
+                break;
+            }
+        }
+        if (fit.width == size && fit.height == size) {
+            // the last try left other positions behind
+            pack_page(&sky, entries, order, first, first + placed, page, size,
+                      size);
+        }
+        da_append(pages, fit);
+        first += placed;
+    }
+    da_free(sky);
+}
+
+// Draws the trimmed image of entry into a page in the layout of
+// encode_png_image, one byte per pixel if wide.
+void blit_trimmed(unsigned char *image, int page_width, const Sprite *sprite,
+                  const AtlasEntry *entry, bool wide) {
+    int stride = wide ? page_width : (page_width + 1) / 2;
+    for (int r = 0; r < entry->height; r++) {
+        uint64_t row = trimmed_row(sprite->pixels, entry, r);
+        unsigned char *line = image + (entry->page_y + r) * stride;
+        if (wide) {
+            for (int c = 0; c < entry->width; c++) {
+                line[entry->page_x + c] =
+                    sprite->palette << 4 | (row >> 4 * c & 0xF);
+            }
+            continue;
+        }
+        for (int c = 0; c < entry->width; c++) {
+            int x = entry->page_x + c;
+            int shift = x % 2 ? 0 : 4;
+            line[x / 2] = (line[x / 2] & ~(0xF << shift)) |
+                          (row >> 4 * c & 0xF) << shift;
+        }
+    }
+}
+
+// Writes the sprites at indices (all if NULL) as an atlas. The pages go to
+// <stem>_<n>.png and the manifest to <stem>.json or .csv, where stem is path
+// without its extension.
+int export_atlas(const char *path, const int *indices, int count,
+                 ManifestFormat format) {
+    double start = GetTime();
+    AtlasEntry *entries = calloc(count, sizeof(AtlasEntry));
+    int *order = malloc(count * sizeof(int));
+    int unique = 0;
+    AtlasPages pages = {0};
+    String_Builder png = {0};
+    String_Builder manifest = {0};
+    unsigned char *image = NULL;
+    int result = 0;
+
+    int table_size = 1;
+    while (table_size < 2 * count) {
+        table_size *= 2;
+    }
+    int *table = malloc(table_size * sizeof(int));
+    memset(table, -1, table_size * sizeof(int));
+    // sprites in other palettes only share a spot in an 8 bit page
+    int palette = common_palette(indices, count);
+    for (int k = 0; k < count; k++) {
+        const Sprite *sprite = &SPRITES.items[indices ? indices[k] : k];
+        const unsigned char *pixels = sprite->pixels;
+        AtlasEntry *entry = &entries[k];
+        trim_sprite(pixels, entry);
+        entry->original = k;
+        if (entry->width == 0) {
+            entry->page = -1;
+            continue;
+        }
+        entry->hash = trimmed_hash(pixels, entry);
+        uint32_t slot = entry->hash & (table_size - 1);
+        for (; table[slot] != -1; slot = (slot + 1) & (table_size - 1)) {
+            const AtlasEntry *other = &entries[table[slot]];
+            const Sprite *other_sprite =
+                &SPRITES.items[indices ? indices[table[slot]] : table[slot]];
+            if (other->hash == entry->hash &&
+                other_sprite->palette == sprite->palette &&
+                same_trimmed(other_sprite->pixels, other, pixels, entry)) {
+                entry->original = table[slot];
+                break;
+            }
+        }
+        if (entry->original == k) {
+            table[slot] = k;
+            order[unique++] = k;
+        }
+    }
+    free(table);
+
+    SORT_ENTRIES = entries;
+    qsort(order, unique, sizeof(int), compare_boxes);
+    pack_atlas(entries, order, unique, &pages);
+
+    int stem = path_stem(path);
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    int name_len = path + stem - name;
+    int64_t packed_area = 0;
+    for (int page = 0; page < pages.count; page++) {
+        int width = pages.items[page].width;
+        int height = pages.items[page].height;
+        size_t size = (size_t)(palette < 0 ? width : (width + 1) / 2) * height;
+        packed_area += (int64_t)width * height;
+        image = realloc(image, size);
+        memset(image, TRANSPARENT_INDEX * (palette < 0 ? 1 : 0x11), size);
+        for (int k = 0; k < unique; k++) {
+            const AtlasEntry *entry = &entries[order[k]];
+            if (entry->page == page) {
+                int index = indices ? indices[order[k]] : order[k];
+                blit_trimmed(image, width, &SPRITES.items[index], entry,
+                             palette < 0);
+            }
+        }
+        png.count = 0;
+        const char *page_path = temp_sprintf("%.*s_%d.png", stem, path, page);
+        if (!encode_png_image(&png, image, width, height, palette)) {
+            TraceLog(LOG_ERROR, "Error encoding %s", page_path);
+            result = -1;
+            goto cleanup;
+        }
+        if (!write_entire_file(page_path, png.items, png.count)) {
+            result = -1;
+            goto cleanup;
+        }
+        temp_reset();
+    }
+
+    bool json = format == MANIFEST_JSON;
+    if (json) {
+        sb_append_cstr(&manifest, "{\"pages\": [\n");
+        for (int page = 0; page < pages.count; page++) {
+            sb_append_cstr(&manifest, "  {\"image\": ");
+            append_quoted(&manifest,
+                          temp_sprintf("%.*s_%d.png", name_len, name, page),
+                          true);
+            sb_append_cstr(&manifest,
+                           temp_sprintf(", \"width\": %d, \"height\": %d}%s\n",
+                                        pages.items[page].width,
+                                        pages.items[page].height,
+                                        page + 1 < pages.count ? "," : ""));
+            temp_reset();
+        }
+        sb_append_cstr(&manifest, "], \"sprites\": [\n");
+    } else {
+        sb_append_cstr(&manifest, "name,page,x,y,w,h,offset_x,offset_y\n");
+    }
+    for (int k = 0; k < count; k++) {
+        const Sprite *sprite = &SPRITES.items[indices ? indices[k] : k];
+        const AtlasEntry *entry = &entries[k];
+        // empty sprites are on page -1 with an empty box
+        const AtlasEntry *packed = &entries[entry->original];
+        if (json) {
+            sb_append_cstr(&manifest, "  {\"name\": ");
+        }
+        append_quoted(&manifest, sprite->name, json);
+        sb_append_cstr(
+            &manifest,
+            json ? temp_sprintf(", \"page\": %d, \"x\": %d, \"y\": %d, "
+                                "\"w\": %d, \"h\": %d, \"offset_x\": %d, "
+                                "\"offset_y\": %d}%s\n",
+                                packed->page, packed->page_x, packed->page_y,
+                                entry->width, entry->height, entry->x,
+                                entry->y, k + 1 < count ? "," : "")
+                 : temp_sprintf(",%d,%d,%d,%d,%d,%d,%d\n", packed->page,
+                                packed->page_x, packed->page_y, entry->width,
+                                entry->height, entry->x, entry->y));
+        temp_reset();
+    }
+    if (json) {
+        sb_append_cstr(&manifest, "]}\n");
+    }
+    const char *manifest_path =
+        temp_sprintf("%.*s.%s", stem, path, json ? "json" : "csv");
+    if (!write_entire_file(manifest_path, manifest.items, manifest.count)) {
+        result = -1;
+        goto cleanup;
+    }
+    TraceLog(LOG_INFO,
+             "packed %d sprites (%d unique) into %d pages, %.0f%% of a grid, "
+             "in %.1f ms",
+             count, unique, pages.count,
+             count ? 100.0 * packed_area / ((int64_t)count * SPRITE_SIZE *
+                                            SPRITE_SIZE)
+                   : 0.0,
+             (GetTime() - start) * 1000);
+
+cleanup:
+    free(entries);
+    free(order);
+    free(image);
+    da_free(pages);
+    sb_free(png);
+    sb_free(manifest);
+    temp_reset();
+    return result;
+}
+
+void export_selected_atlas() {
+    char *path = string_popup("Export atlas, pages are named <path>_<n>.png",
+                              "", 256);
+    if (path == NULL) {
+        return;
+    }
+    IntList indices = {0};
+    selected_indices(&indices);
+    export_atlas(path, indices.items, indices.count, MANIFEST_JSON);
+    da_free(indices);
+    free(path);
+}
+
+// Texture export for games that upload sprites without decoding them. The
+// sprites are laid out like a sheet on square pages, row by row, and every
+// page becomes one layer of the texture. Sprite k is on layer k / cells, at
+// column k % cells % columns and row k % cells / columns, where columns is
+// the page size / 16 and cells is columns squared.
+//
+// Pages are converted from the 4bpp bitmaps one row of sprites at a time and
+// every mip level of that row is written straight to its place in the file,
+// so memory use does not depend on the bank size. Levels below one pixel per
+// sprite mix sprites and are made from a small per page image at the end.
+int TEXTURE_PAGE_SIZE = 2048;
+
+typedef enum {
+    // colors from the palette, straight alpha
+    TEXTURE_RGBA8,
+    // the color indices, for palette lookups in a shader, with the palette
+    // in the high nibble if the bank has more than one
+    TEXTURE_R8,
+} TextureFormat;
+
+enum { MAX_TEXTURE_LEVELS = 16 };
+
+typedef struct {
+    const int *indices;
+    int count;
+    TextureFormat format;
+    int bytes_per_pixel;
+    int side;
+    int columns;
+    int pages;
+    int levels;
+    int fd;
+    // start of level l of the first page, the pages follow each other
+    uint64_t offsets[MAX_TEXTURE_LEVELS];
+    int page;
+    // one row of sprites per worker, and the page at one pixel per sprite
+    unsigned char *bands[MAX_PARALLEL];
+    unsigned char *tail;
+    // set by whichever row worker fails to write
+    atomic_bool failed;
+} TextureExport;
+
+uint64_t level_size(const TextureExport *tex, int level) {
+    uint64_t side = tex->side >> level;
+    return side * side * tex->bytes_per_pixel;
+}
+
+// Halves an image in place. Colors are weighted by alpha so transparent
+// pixels do not darken the edges, indices take the top left pixel.
+void halve_texture(unsigned char *image, int width, int height,
+                   TextureFormat format) {
+    int half_width = width / 2;
+    for (int y = 0; y < height / 2; y++) {
+        for (int x = 0; x < half_width; x++) {
+            if (format == TEXTURE_R8) {
+                image[y * half_width + x] = image[2 * y * width + 2 * x];
+                continue;
+            }
+            unsigned char *quad[4] = {
+                image + 4 * (2 * y * width + 2 * x),
+                image + 4 * (2 * y * width + 2 * x + 1),
+                image + 4 * ((2 * y + 1) * width + 2 * x),
+                image + 4 * ((2 * y + 1) * width + 2 * x + 1),
+            };
+            int sums[4] = {0};
+            for (int i = 0; i < 4; i++) {
+                for (int c = 0; c < 3; c++) {
+                    sums[c] += quad[i][c] * quad[i][3];
+                }
+                sums[3] += quad[i][3];
+            }
+            unsigned char *out = image + 4 * (y * half_width + x);
+            for (int c = 0; c < 3; c++) {
+                out[c] = sums[3] ? (sums[c] + sums[3] / 2) / sums[3] : 0;
+            }
+            out[3] = (sums[3] + 2) / 4;
+        }
+    }
+}
+
+void write_level_part(TextureExport *tex, int level, uint64_t at,
+                      const unsigned char *data, size_t size) {
+    uint64_t offset =
+        tex->offsets[level] + tex->page * level_size(tex, level) + at;
+    while (size > 0) {
+        ssize_t written = pwrite(tex->fd, data, size, offset);
+        if (written <= 0) {
+            tex->failed = true;
+            return;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+void export_texture_rows(void *ctx, int begin, int end, int worker) {
+    TextureExport *tex = ctx;
+    int bpp = tex->bytes_per_pixel;
+    unsigned char *band = tex->bands[worker];
+    uint32_t colors[MAX_PALETTES][NUM_COLORS];
+    memcpy(colors, PALETTES, PALETTE_COUNT * sizeof(colors[0]));
+    // indices carry the palette in the high nibble once there are several
+    bool high = PALETTE_COUNT > 1;
+    uint64_t empty = NIBBLE_ONES * TRANSPARENT_INDEX;
+    for (int grid_row = begin; grid_row < end; grid_row++) {
+        for (int column = 0; column < tex->columns; column++) {
+            int k = (tex->page * tex->columns + grid_row) * tex->columns +
+                    column;
+            const Sprite *sprite =
+                k < tex->count
+                    ? &SPRITES.items[tex->indices ? tex->indices[k] : k]
+                    : NULL;
+            int palette = sprite ? sprite->palette : 0;
+            for (int y = 0; y < SPRITE_SIZE; y++) {
+                uint64_t row =
+                    sprite ? load_row(sprite->pixels + y * ROW_BYTES) : empty;
+                unsigned char *out =
+                    band + (y * tex->side + column * SPRITE_SIZE) * bpp;
+                for (int x = 0; x < SPRITE_SIZE; x++, row >>= 4) {
+                    if (tex->format == TEXTURE_R8) {
+                        out[x] = (high ? palette << 4 : 0) | (row & 0xF);
+                    } else {
+                        memcpy(out + 4 * x, &colors[palette][row & 0xF], 4);
+                    }
+                }
+            }
+        }
+        for (int level = 0; level < tex->levels && level <= 4; level++) {
+            int width = tex->side >> level;
+            int rows = SPRITE_SIZE >> level;
+            if (level > 0) {
+                halve_texture(band, 2 * width, 2 * rows, tex->format);
+            }
+            size_t size = (size_t)rows * width * bpp;
+            write_level_part(tex, level, grid_row * size, band, size);
+        }
+        if (tex->levels > 5) {
+            memcpy(tex->tail + grid_row * tex->columns * bpp, band,
+                   tex->columns * bpp);
+        }
+    }
+}
+
+// KTX2 header, level index and data format descriptor, with the levels
+// placed from the smallest to the largest as the format wants.
+void ktx2_header(TextureExport *tex, String_Builder *out) {
+    bool rgba = tex->format == TEXTURE_RGBA8;
+    int samples = rgba ? 4 : 1;
+    uint32_t dfd_size = 4 + 24 + 16 * samples;
+    uint32_t dfd_offset = 80 + 24 * tex->levels;
+    uint64_t offset = dfd_offset + dfd_size;
+    for (int level = tex->levels - 1; level >= 0; level--) {
+        // levels start on 4 byte boundaries
+        offset = (offset + 3) & ~(uint64_t)3;
+        tex->offsets[level] = offset;
+        offset += level_size(tex, level) * tex->pages;
+    }
+
+    sb_append_buf(out, "\xabKTX 20\xbb\r\n\x1a\n", 12);
+    // VK_FORMAT_R8G8B8A8_UNORM or VK_FORMAT_R8_UNORM
+    append_le32(out, rgba ? 37 : 9);
+    append_le32(out, 1);
+    append_le32(out, tex->side);
+    append_le32(out, tex->side);
+    append_le32(out, 0);
+    // 0 means not an array texture
+    append_le32(out, tex->pages > 1 ? tex->pages : 0);
+    append_le32(out, 1);
+    append_le32(out, tex->levels);
+    // no supercompression
+    append_le32(out, 0);
+    append_le32(out, dfd_offset);
+    append_le32(out, dfd_size);
+    // no key/value data and no supercompression data
+    append_le32(out, 0);
+    append_le32(out, 0);
+    append_le64(out, 0);
+    append_le64(out, 0);
+    for (int level = 0; level < tex->levels; level++) {
+        uint64_t size = level_size(tex, level) * tex->pages;
+        append_le64(out, tex->offsets[level]);
+        append_le64(out, size);
+        append_le64(out, size);
+    }
+
+    // one basic descriptor block: RGBSDA color model, BT.709 primaries,
+    // linear transfer, straight alpha, 1x1 texel blocks
+    append_le32(out, dfd_size);
+    append_le32(out, 0);
+    append_le32(out, (dfd_size - 4) << 16 | 2);
+    append_le32(out, 1 | 1 << 8 | 1 << 16);
+    append_le32(out, 0);
+    append_le32(out, tex->bytes_per_pixel);
+    append_le32(out, 0);
+    unsigned char channels[4] = {0, 1, 2, 15};
+    for (int i = 0; i < samples; i++) {
+        // 8 bits at bit 8i, unsigned, normalized to 0..255
+        append_le32(out, 8 * i | 7 << 16 | (uint32_t)channels[i] << 24);
+        append_le32(out, 0);
+        append_le32(out, 0);
+        append_le32(out, 255);
+    }
+}
+
+// Writes the sprites at indices (all if NULL) as a texture with the full mip
+// chain if mips is set. A path ending in .ktx2 gets a KTX2 container, any
+// other path the bare levels from the largest to the smallest.
+int export_texture(const char *path, const int *indices, int count,
+                   TextureFormat format, bool mips) {
+    double start = GetTime();
+    TextureExport tex = {
+        .indices = indices,
+        .count = count,
+        .format = format,
+        .bytes_per_pixel = format == TEXTURE_RGBA8 ? 4 : 1,
+        .side = SPRITE_SIZE,
+    };
+    // the smallest page that holds everything, up to TEXTURE_PAGE_SIZE
+    while (tex.side < TEXTURE_PAGE_SIZE &&
+           (int64_t)tex.side * tex.side < (int64_t)count * SPRITE_SIZE *
+                                               SPRITE_SIZE) {
+        tex.side *= 2;
+    }
+    tex.columns = tex.side / SPRITE_SIZE;
+    int cells = tex.columns * tex.columns;
+    tex.pages = count > 0 ? (count + cells - 1) / cells : 1;
+    tex.levels = 1;
+    while (mips && tex.side >> tex.levels > 0) {
+        tex.levels++;
+    }
+
+    size_t len = strlen(path);
+    bool ktx2 = len > 5 && strcmp(path + len - 5, ".ktx2") == 0;
+    String_Builder header = {0};
+    if (ktx2) {
+        ktx2_header(&tex, &header);
+    } else {
+        uint64_t offset = 0;
+        for (int level = 0; level < tex.levels; level++) {
+            tex.offsets[level] = offset;
+            offset += level_size(&tex, level) * tex.pages;
+        }
+    }
+
+    int result = 0;
+    int workers = parallel_worker_count();
+    tex.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tex.fd < 0) {
+        TraceLog(LOG_ERROR, "Could not open %s: %s", path, strerror(errno));
+        result = -1;
+        goto cleanup;
+    }
+    if (pwrite(tex.fd, header.items, header.count, 0) !=
+        (ssize_t)header.count) {
+        tex.failed = true;
+    }
+    for (int i = 0; i < workers; i++) {
+        tex.bands[i] = malloc((size_t)tex.side * SPRITE_SIZE *
+                              tex.bytes_per_pixel);
+    }
+    tex.tail = malloc((size_t)tex.columns * tex.columns * tex.bytes_per_pixel);
+    for (tex.page = 0; tex.page < tex.pages && !tex.failed; tex.page++) {
+        parallel_for(tex.columns, export_texture_rows, &tex);
+        for (int level = 5; level < tex.levels; level++) {
+            int width = tex.side >> level;
+            halve_texture(tex.tail, 2 * width, 2 * width, format);
+            write_level_part(&tex, level, 0, tex.tail,
+                             level_size(&tex, level));
+        }
+    }
+    if (tex.failed) {
+        TraceLog(LOG_ERROR, "Could not write %s", path);
+        result = -1;
+        goto cleanup;
+    }
+    TraceLog(LOG_INFO, "exported %d sprites to %s, %d %dx%d pages, %d levels, "
+                       "in %.1f ms",
+             count, path, tex.pages, tex.side, tex.side, tex.levels,
+             (GetTime() - start) * 1000);
+
+cleanup:
+    if (tex.fd >= 0) {
+        close(tex.fd);
+    }
+    for (int i = 0; i < workers; i++) {
+        free(tex.bands[i]);
+    }
+    free(tex.tail);
+    sb_free(header);
+    return result;
+}
+
+// keyboard shortcuts of the gallery that act on the selection
+void gallery_shortcuts() {
+    if (command_down() && IsKeyPressed(KEY_A)) {
+        select_all(true);
+    }
+    if (command_down() && IsKeyPressed(KEY_Z)) {
+        undo();
+    }
+    // shows every sprite in one palette, then all in their own again
+    if (IsKeyPressed(KEY_TAB)) {
+        GALLERY_PALETTE++;
+        if (GALLERY_PALETTE >= PALETTE_COUNT) {
+            GALLERY_PALETTE = -1;
+        }
+    }
+    if (SELECTED_COUNT == 0) {
+        return;
+    }
+    if (!command_down() && IsKeyPressed(KEY_P) && PALETTE_COUNT > 1) {
+        cycle_selected_palette();
+    }
+    if (IsKeyPressed(KEY_ESCAPE)) {
+        select_all(false);
+    }
+    if (IsKeyPressed(KEY_DELETE) || IsKeyPressed(KEY_BACKSPACE)) {
+        delete_selected();
+    }
+    if (command_down()) {
+        if (IsKeyPressed(KEY_D)) {
+            duplicate_selected();
+        }
+        if (IsKeyPressed(KEY_LEFT) || IsKeyPressed(KEY_UP)) {
+            move_selected(-1);
+        }
+        if (IsKeyPressed(KEY_RIGHT) || IsKeyPressed(KEY_DOWN)) {
+            move_selected(1);
+        }
+        if (IsKeyPressed(KEY_HOME)) {
+            move_selected_to_end(true);
+        }
+        if (IsKeyPressed(KEY_END)) {
+            move_selected_to_end(false);
+        }
+    }
+    // plain arrows turn pages, shifting needs shift held down
+    int transform = transform_pressed();
+    if (transform >= TRANSFORM_SHIFT_LEFT && !shift_down()) {
+        transform = -1;
+    }
+    if (transform >= 0) {
+        transform_selected(transform);
+    }
+}
+
+// time from scrolling to a new row until all visible thumbnails were on screen
+double FILL_START = -1;
+double FILL_LATENCY = 0;
+// CPU time spent laying out and batching the visible cells last frame
+double GALLERY_TIME = 0;
+
+typedef struct {
+    // screenfuls of rows to prepare in the direction the user is scrolling
+    int pages;
+    // bytes of decoded thumbnails prefetching may claim
+    size_t budget;
+    int direction;
+    int last_row;
+} Prefetch;
+
+Prefetch PREFETCH = {
+    .pages = 4,
+    .budget = 4 << 20,
+    .direction = 1,
+    .last_row = -1,
+};
+
+// Requests the rows ahead of the visible ones, plus a screen behind. Moving
+// on in the same direction keeps the queued work, turning around or jumping
+// further than a screen means the queue is stale.
+void prefetch_rows(int first_row, int visible_rows, int total_rows,
+                   int row_len, int level) {
+    if (first_row != PREFETCH.last_row) {
+        int step = first_row - PREFETCH.last_row;
+        int direction = step > 0 ? 1 : -1;
+        if (direction != PREFETCH.direction || abs(step) > visible_rows) {
+            thumb_cancel_prefetch();
+        }
+        PREFETCH.direction = direction;
+        PREFETCH.last_row = first_row;
+    }
+    int side = SPRITE_SIZE >> level;
+    int allowed = PREFETCH.budget / (side * side * sizeof(Color));
+    int ahead = PREFETCH.pages * visible_rows;
+    // rows in the order they should be ready, the last screen is behind
+    for (int n = 0; n < ahead + visible_rows && allowed > 0; n++) {
+        bool behind = n >= ahead;
+        int distance = behind ? n - ahead : n;
+        int direction = behind ? -PREFETCH.direction : PREFETCH.direction;
+        int row = direction > 0 ? first_row + visible_rows + distance
+                                : first_row - 1 - distance;
+        if (row < 0 || row >= total_rows) {
+            continue;
+        }
+        for (int i = row * row_len;
+             i < SPRITES.count && i < (row + 1) * row_len && allowed > 0;
+             i++, allowed--) {
+            Sprite *sprite = &SPRITES.items[i];
+            Rectangle src;
+            atlas_request(sprite, shown_palette(sprite), level, &src, false);
+        }
+    }
+}
+
+// Sizes the gallery sprites can be shown at, in screen pixels. Below 16 the
+// thumbnails come from the downsampled atlas levels.
+const int ZOOM_STEPS[] = {2,  4,  8,   16,  32,  48,  64,
+                          96, 128, 160, 192, 240, 320, 480};
+// at the first step, which is 16 * MAX_PIXEL_SCALE
+const int DEFAULT_ZOOM = 11;
+// smallest sprite size at which names are still readable under the cell
+const int NAME_MIN_ZOOM = 64;
+
+// Only depends on the size of the gallery and the zoom, so it is computed
+// when one of them changes.
+typedef struct {
+    Rectangle rect;
+    int zoom;
+    Rectangle cells;
+    Rectangle scrollbar;
+    int row_len;
+    float cell_width;
+    float cell_height;
+    // side of a sprite on screen
+    int sprite_size;
+    // where the thumbnails come from
+    int level;
+    bool show_names;
+} GalleryLayout;
+
+typedef struct {
+    GalleryLayout layout;
+    // index into ZOOM_STEPS
+    int zoom;
+    // in pixels from the top of the first row, a double since at a million
+    // sprites it passes where a float still holds fractions of a pixel
+    double scroll;
+    // scroll eases towards this
+    double target;
+    bool dragging_scrollbar;
+    float drag_offset;
+} Gallery;
+
+Gallery GALLERY = {.zoom = DEFAULT_ZOOM};
+
+const float SCROLLBAR_WIDTH = LITTLE_MARGIN * 1.5;
+// fraction of the remaining distance scrolled per second
+const float SCROLL_SPEED = 20;
+
+GalleryLayout gallery_layout(Rectangle rect, int zoom) {
+    GalleryLayout layout = {.rect = rect, .zoom = zoom};
+    RectTuple split = vsplit(rect, rect.width - SCROLLBAR_WIDTH - MARGINS,
+                             SCROLLBAR_WIDTH);
+    layout.cells = split.r1;
+    layout.scrollbar = split.r2;
+    layout.sprite_size = ZOOM_STEPS[zoom];
+    layout.level = 0;
+    while (layout.level < ATLAS_LEVELS - 1 &&
+           SPRITE_SIZE >> layout.level > layout.sprite_size) {
+        layout.level++;
+    }
+    layout.show_names = layout.sprite_size >= NAME_MIN_ZOOM;
+    // tiny sprites are packed without gaps
+    float padding = layout.sprite_size >= SPRITE_SIZE ? LITTLE_MARGIN : 0;
+    layout.row_len = layout.cells.width / (layout.sprite_size + padding);
+    if (layout.row_len < 1) {
+        layout.row_len = 1;
+    }
+    layout.cell_width = layout.cells.width / layout.row_len;
+    layout.cell_height = layout.sprite_size + padding;
+    if (layout.show_names) {
+        layout.cell_height += SMALL_FONT + LITTLE_MARGIN / 2;
+    }
+    return layout;
+}
+
+int gallery_total_rows() {
+    int row_len = GALLERY.layout.row_len;
+    return row_len == 0 ? 0 : (SPRITES.count + row_len - 1) / row_len;
+}
+
+double gallery_max_scroll() {
+    GalleryLayout *layout = &GALLERY.layout;
+    double content = (double)gallery_total_rows() * layout->cell_height;
+    return content > layout->cells.height ? content - layout->cells.height
+                                          : 0;
+}
+
+// the top visible row
+int gallery_first_row() {
+    return GALLERY.scroll / GALLERY.layout.cell_height;
+}
+
+// how far the top visible row is scrolled out of view, screen positions are
+// computed from here so they stay small enough for floats
+float gallery_row_offset() {
+    return GALLERY.scroll -
+           (double)gallery_first_row() * GALLERY.layout.cell_height;
+}
+
+// first sprite of the top visible row
+int gallery_top() {
+    GalleryLayout *layout = &GALLERY.layout;
+    if (layout->row_len == 0) {
+        return 0;
+    }
+    return gallery_first_row() * layout->row_len;
+}
+
+// keeps the sprite at the top left of the view in place
+void gallery_zoom(int steps) {
+    int zoom = Clamp(GALLERY.zoom + steps, 0, ARRAY_LEN(ZOOM_STEPS) - 1);
+    if (steps == 0 || zoom == GALLERY.zoom) {
+        return;
+    }
+    GalleryLayout *layout = &GALLERY.layout;
+    int top = gallery_top();
+    GALLERY.zoom = zoom;
+    *layout = gallery_layout(layout->rect, zoom);
+    GALLERY.scroll = (double)(top / layout->row_len) * layout->cell_height;
+    GALLERY.target = GALLERY.scroll;
+    thumb_cancel_prefetch();
+}
+
+void gallery_scroll_input() {
+    GalleryLayout *layout = &GALLERY.layout;
+    float screen = floor(layout->cells.height / layout->cell_height) *
+                   layout->cell_height;
+    float wheel = GetMouseWheelMove();
+    if (CheckCollisionPointRec(GetMousePosition(), layout->rect)) {
+        if (command_down()) {
+            gallery_zoom(wheel > 0 ? 1 : wheel < 0 ? -1 : 0);
+        } else {
+            GALLERY.target -= wheel * layout->cell_height;
+        }
+    }
+    if (!command_down() && key_pressed_or_repeat(KEY_EQUAL)) {
+        gallery_zoom(1);
+    }
+    if (!command_down() && key_pressed_or_repeat(KEY_MINUS)) {
+        gallery_zoom(-1);
+    }
+    if (!command_down() && !shift_down()) {
+        if (key_pressed_or_repeat(KEY_DOWN)) {
+            GALLERY.target += layout->cell_height;
+        }
+        if (key_pressed_or_repeat(KEY_UP)) {
+            GALLERY.target -= layout->cell_height;
+        }
+        if (key_pressed_or_repeat(KEY_RIGHT) ||
+            key_pressed_or_repeat(KEY_PAGE_DOWN)) {
+            GALLERY.target += screen;
+        }
+        if (key_pressed_or_repeat(KEY_LEFT) ||
+            key_pressed_or_repeat(KEY_PAGE_UP)) {
+            GALLERY.target -= screen;
+        }
+        if (IsKeyPressed(KEY_HOME)) {
+            GALLERY.target = 0;
+        }
+        if (IsKeyPressed(KEY_END)) {
+            GALLERY.target = gallery_max_scroll();
+        }
+    }
+}
+
+// draws the scrollbar and lets it be dragged
+void gallery_scrollbar() {
+    GalleryLayout *layout = &GALLERY.layout;
+    Rectangle track = layout->scrollbar;
+    double content = (double)gallery_total_rows() * layout->cell_height;
+    if (content <= layout->cells.height) {
+        return;
+    }
+    DrawRectangleRec(track, POPUP_BACKGROUND);
+    Rectangle thumb = track;
+    thumb.height = fmax(track.height * layout->cells.height / content,
+                        SCROLLBAR_WIDTH);
+    float travel = track.height - thumb.height;
+    thumb.y += travel * GALLERY.scroll / gallery_max_scroll();
+    DrawRectangleRec(thumb, BUTTON_COLOR);
+
+    Vector2 mouse = GetMousePosition();
+    if (IsMouseButtonPressed(0) && CheckCollisionPointRec(mouse, track)) {
+        GALLERY.dragging_scrollbar = true;
+        // grabbing the track outside the thumb centers the thumb there
+        GALLERY.drag_offset = CheckCollisionPointRec(mouse, thumb)
+                                  ? mouse.y - thumb.y
+                                  : thumb.height / 2;
+    }
+    if (!IsMouseButtonDown(0)) {
+        GALLERY.dragging_scrollbar = false;
+    }
+    if (GALLERY.dragging_scrollbar && travel > 0) {
+        float t = (mouse.y - GALLERY.drag_offset - track.y) / travel;
+        GALLERY.target = fmin(fmax(t, 0), 1) * gallery_max_scroll();
+        // the thumb follows the mouse directly
+        GALLERY.scroll = GALLERY.target;
+    }
+}
+
+Rectangle gallery_cell_rect(int i) {
+    GalleryLayout *layout = &GALLERY.layout;
+    int row = i / layout->row_len - gallery_first_row();
+    return (Rectangle){
+        .x = layout->cells.x + i % layout->row_len * layout->cell_width,
+        .y = layout->cells.y + row * layout->cell_height - gallery_row_offset(),
+        .width = layout->cell_width,
+        .height = layout->cell_height,
+    };
+}
+
+Rectangle gallery_sprite_region(Rectangle cell) {
+    GalleryLayout *layout = &GALLERY.layout;
+    Rectangle sprite_region = {
+        .x = floor(cell.x + (cell.width - layout->sprite_size) / 2),
+        .y = cell.y + (cell.height - layout->sprite_size) / 2,
+        .width = layout->sprite_size,
+        .height = layout->sprite_size,
+    };
+    if (layout->show_names) {
+        sprite_region.y = cell.y + LITTLE_MARGIN / 2;
+    }
+    return sprite_region;
+}
+
+// the sprites of the visible cells in one framebuffer
+void gallery_software(int first, int last) {
+    GalleryLayout *layout = &GALLERY.layout;
+    framebuffer_begin(layout->cells);
+    for (int i = first; i < last; i++) {
+        Sprite *sprite = &SPRITES.items[i];
+        Rectangle region = gallery_sprite_region(gallery_cell_rect(i));
+        framebuffer_sprite(sprite->pixels, PALETTES[shown_palette(sprite)],
+                           region.x, floor(region.y), layout->sprite_size,
+                           false);
+    }
+    framebuffer_end();
+}
+
+// everything but the sprite when rendering in software
+void gallery_cell(Rectangle cell, int i) {
+    GalleryLayout *layout = &GALLERY.layout;
+    Sprite *s = &SPRITES.items[i];
+    Rectangle sprite_region = gallery_sprite_region(cell);
+    if (!SOFTWARE_RENDER) {
+        Rectangle src;
+        atlas_request(s, shown_palette(s), layout->level, &src, true);
+        DrawTexturePro(ATLAS[layout->level].texture, src, sprite_region,
+                       (Vector2){0}, 0, WHITE);
+    }
 
-        if (clickable_region(colorpad)) {
-            *selected = i;
-        }
-        if (*selected == i) {
-            draw_dashed_outline(colorpad, MARK_LINE_THICK, 5);
+    if (layout->show_names) {
+        draw_text(s->name, cell.x + LITTLE_MARGIN / 2,
+                  sprite_region.y + sprite_region.height + LITTLE_MARGIN / 2,
+                  SMALL_FONT, cell.width - LITTLE_MARGIN, TEXT_COLOR);
+    }
+    if (s->selected) {
+        if (layout->sprite_size >= SPRITE_SIZE) {
+            draw_dashed_outline(cell, MARK_LINE_THICK, 9);
+        } else {
+            DrawRectangleRec(cell, Fade(WHITE, 0.5));
         }
     }
 }
 
-void edit_colors() {
-    int selected = -1;
-    bool should_exit = false;
+// Only the rows intersecting the view are touched, so the cost per frame does
+// not depend on how many sprites there are. All cells are drawn from one
+// atlas texture, which keeps even a zoomed out view of thousands of sprites
+// in a handful of draw calls.
+int sprite_selector(Rectangle rect) {
+    double start = GetTime();
+    int sprite_to_edit = -1;
+    if (memcmp(&rect, &GALLERY.layout.rect, sizeof(Rectangle)) != 0 ||
+        GALLERY.layout.zoom != GALLERY.zoom) {
+        GALLERY.layout = gallery_layout(rect, GALLERY.zoom);
+    }
+    GalleryLayout *layout = &GALLERY.layout;
+    Rectangle cells = layout->cells;
 
-    while (!should_exit) {
+    gallery_scroll_input();
+    gallery_scrollbar();
+    // not Clamp, that would round to a float
+    GALLERY.target = fmin(fmax(GALLERY.target, 0), gallery_max_scroll());
+    float ease = fmin(1, GetFrameTime() * SCROLL_SPEED);
+    GALLERY.scroll += (GALLERY.target - GALLERY.scroll) * ease;
+    if (fabs(GALLERY.target - GALLERY.scroll) < 0.5) {
+        GALLERY.scroll = GALLERY.target;
+    }
 
-        BeginDrawing();
-        ClearBackground(BACKGROUND);
+    int total_rows = gallery_total_rows();
+    int first_row = gallery_first_row();
+    int visible_rows = ceil(cells.height / layout->cell_height) + 1;
+    int first = first_row * layout->row_len;
+    int last = (first_row + visible_rows) * layout->row_len;
+    if (last > SPRITES.count) {
+        last = SPRITES.count;
+    }
+    if (first_row != PREFETCH.last_row) {
+        FILL_START = GetTime();
+    }
 
-        Rectangle main_region = setup_screen("Editing Color Palette");
-        RectTuple main_split = vsplit(main_region, 3, 2);
+    // hit testing is arithmetic on the grid instead of a check per cell
+    Vector2 mouse = GetMousePosition();
+    int hovered = -1;
+    if (CheckCollisionPointRec(mouse, cells) && !GALLERY.dragging_scrollbar) {
+        int column = (mouse.x - cells.x) / layout->cell_width;
+        int row = first_row + (mouse.y - cells.y + gallery_row_offset()) /
+                                  layout->cell_height;
+        int i = row * layout->row_len + column;
+        if (column < layout->row_len && i < SPRITES.count) {
+            hovered = i;
+        }
+    }
 
-        color_selector(main_split.r1, &selected, (Color *)&NEW_COLORS);
+    if (SOFTWARE_RENDER) {
+        gallery_software(first, last);
+    }
+    BeginScissorMode(cells.x, cells.y, cells.width, cells.height);
+    for (int i = first; i < last; i++) {
+        Rectangle cell = gallery_cell_rect(i);
+        gallery_cell(cell, i);
+        if (i == hovered) {
+            float thick = fmin(MARK_LINE_THICK, layout->sprite_size / 4.0);
+            DrawRectangleLinesEx(cell, fmax(thick, 1), TEXT_COLOR);
+        }
+    }
+    EndScissorMode();
 
-        RectTuple edit_split = chop_bottom(main_split.r2, BUTTON_HEIGHT);
+    if (hovered >= 0 && IsMouseButtonPressed(0)) {
+        Sprite *s = &SPRITES.items[hovered];
+        if (command_down()) {
+            s->selected = !s->selected;
+            SELECTED_COUNT += s->selected ? 1 : -1;
+            SELECT_ANCHOR = hovered;
+        } else if (shift_down()) {
+            int from = SELECT_ANCHOR < hovered ? SELECT_ANCHOR : hovered;
+            int to = SELECT_ANCHOR < hovered ? hovered : SELECT_ANCHOR;
+            for (int j = from; j <= to && j < SPRITES.count; j++) {
+                SELECTED_COUNT += !SPRITES.items[j].selected;
+                SPRITES.items[j].selected = true;
+            }
+        } else {
+            sprite_to_edit = hovered;
+            SELECT_ANCHOR = hovered;
+        }
+    }
 
-        if (selected >= 0) {
-            color_sliders(&NEW_COLORS[selected], edit_split.r1);
+    if (FILL_START >= 0) {
+        bool filled = true;
+        for (int i = first; i < last && filled; i++) {
+            Sprite *sprite = &SPRITES.items[i];
+            filled = SOFTWARE_RENDER ||
+                     atlas_ready(sprite, shown_palette(sprite), layout->level);
+        }
+        if (filled) {
+            FILL_LATENCY = GetTime() - FILL_START;
+            FILL_START = -1;
         }
+    }
+
+    prefetch_rows(first_row, visible_rows, total_rows, layout->row_len,
+                  layout->level);
+    GALLERY_TIME = GetTime() - start;
+    return sprite_to_edit;
+}
 
-        RectTuple button_split = vsplit(edit_split.r2, 1, 1);
+// Index of every sprite by id, open addressing with 0 as the free id. It is
+// not kept up to date as sprites move, a lookup that finds a sprite with
+// another id there rebuilds it, at most once per reload.
+typedef struct {
+    unsigned *ids;
+    int *indices;
+    size_t mask;
+    bool fresh;
+} SpriteIndex;
 
-        should_exit = button("exit", button_split.r1, BUTTON_COLOR);
+SpriteIndex SPRITE_INDEX = {0};
 
-        if (button("save", button_split.r2, BUTTON_COLOR)) {
-            memcpy(&COLORS, &NEW_COLORS, sizeof(Color) * NUM_COLORS);
+void sprite_index_rebuild() {
+    SpriteIndex *map = &SPRITE_INDEX;
+    size_t size = 16;
+    while (size < 2 * (size_t)SPRITES.count) {
+        size *= 2;
+    }
+    map->ids = realloc(map->ids, size * sizeof(unsigned));
+    map->indices = realloc(map->indices, size * sizeof(int));
+    memset(map->ids, 0, size * sizeof(unsigned));
+    map->mask = size - 1;
+    for (int i = 0; i < SPRITES.count; i++) {
+        size_t slot = SPRITES.items[i].id * 2654435761u & map->mask;
+        while (map->ids[slot] != 0) {
+            slot = (slot + 1) & map->mask;
         }
-        EndDrawing();
+        map->ids[slot] = SPRITES.items[i].id;
+        map->indices[slot] = i;
     }
-    return;
+    map->fresh = true;
 }
 
-void edit_sprite(int idx) {
-    memcpy(&EDIT_BUF, SPRITES.items[idx].pixels, SPRITE_SIZE * SPRITE_SIZE / 2);
-    bool was_changed = false;
-    char *name = SPRITES.items[idx].name;
-    int color = -1;
-start:
-    bool should_exit = false;
-    while (!should_exit) {
-        SetMouseCursor(0);
-        BeginDrawing();
-        ClearBackground(BACKGROUND);
-        Rectangle main = setup_screen(TextFormat("Edit Sprite: %s", name));
-        RectTuple main_split = vsplit(main, 3, 2);
-
-        Rectangle sprite_rect = fit_square_factor(main_split.r1, 16);
-        if (CheckCollisionPointRec(GetMousePosition(), sprite_rect)) {
-            SetMouseCursor(MOUSE_CURSOR_CROSSHAIR);
-        } else {
-            SetMouseCursor(0);
+int sprite_index_find(unsigned id) {
+    SpriteIndex *map = &SPRITE_INDEX;
+    if (map->ids == NULL) {
+        return -1;
+    }
+    for (size_t slot = id * 2654435761u & map->mask; map->ids[slot] != 0;
+         slot = (slot + 1) & map->mask) {
+        if (map->ids[slot] == id) {
+            return map->indices[slot];
         }
-        int pixel_scale = sprite_rect.width / 16;
-        draw_sprite((unsigned char *)&EDIT_BUF, pixel_scale, sprite_rect.x,
-                    sprite_rect.y);
-        for (int i = 0; i < SPRITE_SIZE * SPRITE_SIZE; i++) {
-            int x = i % SPRITE_SIZE;
-            int y = i / SPRITE_SIZE;
-            Rectangle region = {
-                .x = sprite_rect.x + x * pixel_scale,
-                .y = sprite_rect.y + y * pixel_scale,
-                .width = pixel_scale,
-                .height = pixel_scale,
-            };
-            if (color != -1 && pixel(region, DISPLAYCOLORS[color])) {
-                was_changed = true;
-                unsigned char double_pixel = EDIT_BUF[i / 2];
-                if (i % 2 == 0) {
-                    double_pixel &= 0xF0;
-                    double_pixel += (unsigned char)color;
-                } else {
-                    double_pixel &= 0x0F;
-                    double_pixel += (unsigned char)color << 4;
+    }
+    return -1;
+}
+
+// how often the file is checked where inotify is not available, in seconds
+const double WATCH_POLL_INTERVAL = 0.5;
+
+// The open file as it was last loaded or saved. When another program rewrites
+// it, the new contents are compared record by record against this image and
+// only the sprites whose records changed are replaced, so unchanged sprites
+// keep their textures and the editing state.
+typedef struct {
+    char *path;
+    // empty if the file did not match SPRITES when it was watched
+    String_Builder image;
+    // sprite each record was loaded into, and its version then
+    unsigned *ids;
+    unsigned *versions;
+    int count;
+    int inotify;
+    struct stat stat;
+    double next_poll;
+} FileWatch;
+
+FileWatch WATCH = {.inotify = -1};
+
+void unwatch_file() {
+    if (WATCH.inotify >= 0) {
+        close(WATCH.inotify);
+    }
+    free(WATCH.path);
+    free(WATCH.ids);
+    free(WATCH.versions);
+    sb_free(WATCH.image);
+    WATCH = (FileWatch){.inotify = -1};
+    free(SPRITE_INDEX.ids);
+    free(SPRITE_INDEX.indices);
+    SPRITE_INDEX = (SpriteIndex){0};
+}
+
+// Remembers path as it is now, which should match SPRITES record for record,
+// as it does right after loading or saving it. If it doesn't, say because it
+// was only half written, the next reload syncs the store to the file.
+void watch_file(const char *path) {
+    unwatch_file();
+    WATCH.path = strdup(path);
+    stat(path, &WATCH.stat);
+    Bank bank;
+    if (!read_entire_file(path, &WATCH.image) ||
+        !parse_bank((unsigned char *)WATCH.image.items, WATCH.image.count,
+                    &bank) ||
+        bank.count != SPRITES.count) {
+        WATCH.image.count = 0;
+    }
+    WATCH.count = SPRITES.count;
+    WATCH.ids = malloc(WATCH.count * sizeof(unsigned));
+    WATCH.versions = malloc(WATCH.count * sizeof(unsigned));
+    for (int i = 0; i < WATCH.count; i++) {
+        WATCH.ids[i] = SPRITES.items[i].id;
+        WATCH.versions[i] = SPRITES.items[i].version;
+    }
+#ifdef __linux__
+    // the directory is watched, so files replaced by a rename are seen too
+    const char *slash = strrchr(path, '/');
+    char dir[4096] = ".";
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path + 1), path);
+    }
+    WATCH.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (WATCH.inotify >= 0 &&
+        inotify_add_watch(WATCH.inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO) <
+            0) {
+        TraceLog(LOG_WARNING, "could not watch %s, polling instead", dir);
+        close(WATCH.inotify);
+        WATCH.inotify = -1;
+    }
+#endif
+}
+
+// true once the watched file was written since the last call
+bool watch_poll() {
+    if (WATCH.path == NULL) {
+        return false;
+    }
+#ifdef __linux__
+    if (WATCH.inotify >= 0) {
+        const char *slash = strrchr(WATCH.path, '/');
+        const char *base = slash ? slash + 1 : WATCH.path;
+        bool changed = false;
+        char buf[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(WATCH.inotify, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len;) {
+                struct inotify_event *event = (struct inotify_event *)p;
+                if (event->len > 0 && strcmp(event->name, base) == 0) {
+                    changed = true;
                 }
-                EDIT_BUF[i / 2] = double_pixel;
+                p += sizeof(struct inotify_event) + event->len;
             }
         }
+        return changed;
+    }
+#endif
+    if (GetTime() < WATCH.next_poll) {
+        return false;
+    }
+    WATCH.next_poll = GetTime() + WATCH_POLL_INTERVAL;
+    struct stat now;
+    if (stat(WATCH.path, &now) != 0) {
+        return false;
+    }
+    bool changed = now.st_mtime != WATCH.stat.st_mtime ||
+                   now.st_size != WATCH.stat.st_size ||
+                   now.st_ino != WATCH.stat.st_ino;
+    WATCH.stat = now;
+    return changed;
+}
+
+// index of the sprite with id, looking first at hint, where the sprite was
+// when the file was last seen, since records mostly stay where they were
+int find_sprite(unsigned id, int hint) {
+    if (hint < SPRITES.count && SPRITES.items[hint].id == id) {
+        return hint;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        int index = sprite_index_find(id);
+        if (index >= 0 && index < SPRITES.count &&
+            SPRITES.items[index].id == id) {
+            return index;
+        }
+        if (SPRITE_INDEX.fresh) {
+            break;
+        }
+        sprite_index_rebuild();
+    }
+    return -1;
+}
+
+bool sprite_matches_record(const Sprite *sprite, const Bank *bank, int i) {
+    if (sprite->palette != bank_palette(bank, i) ||
+        memcmp(sprite->pixels, bank_pixels(bank, i), SPRITE_BYTES) != 0) {
+        return false;
+    }
+    if (!bank->named) {
+        return true;
+    }
+    int len;
+    const char *name = bank_name(bank, i, &len);
+    return strncmp(sprite->name, name, len) == 0 && sprite->name[len] == '\0';
+}
 
-        RectTuple edit_split = chop_bottom(main_split.r2, BUTTON_HEIGHT);
-        color_selector(edit_split.r1, &color, DISPLAYCOLORS);
+void set_from_record(Sprite *sprite, const Bank *bank, int i) {
+    if (bank->named) {
+        free(sprite->name);
+        sprite->name = name_from_bank(bank, i);
+    }
+    memcpy(sprite->pixels, bank_pixels(bank, i), SPRITE_BYTES);
+    sprite->palette = bank_palette(bank, i);
+    // the file only has the flattened image
+    da_free(sprite->layers);
+    sprite->layers = (LayerList){0};
+    touch_sprite(sprite);
+}
 
-        RectTuple buttons = vsplit(edit_split.r2, 1, 1);
+// Applies what changed in the watched file since it was last seen. Sprites
+// edited here since then keep the edit.
+void reload_changes() {
+    String_Builder image = {0};
+    Bank new;
+    if (!read_entire_file(WATCH.path, &image) ||
+        !parse_bank((unsigned char *)image.items, image.count, &new)) {
+        sb_free(image);
+        return;
+    }
+    Bank old;
+    // Without the old image to compare against, every record is compared
+    // against the sprite it was loaded into. Those edited here still keep
+    // the edit.
+    bool resync = !parse_bank((unsigned char *)WATCH.image.items,
+                              WATCH.image.count, &old);
+    if (resync) {
+        old = (Bank){.named = new.named};
+    }
 
-        if (button("save", buttons.r1, BUTTON_COLOR)) {
-            memcpy(SPRITES.items[idx].pixels, &EDIT_BUF,
-                   SPRITE_SIZE * SPRITE_SIZE / 2);
-            was_changed = false;
+    double start = GetTime();
+    SPRITE_INDEX.fresh = false;
+    int changed = 0;
+    // palettes edited here stay until the file changes them
+    if (old.palette_count == 0 || !same_palettes(&old, &new)) {
+        set_bank_palettes(&new);
+    }
+    NAMED = new.named;
+
+    int common = WATCH.count < new.count ? WATCH.count : new.count;
+    for (int i = 0; i < common; i++) {
+        if (!resync && same_record(&old, &new, i)) {
+            continue;
         }
-        if (button("exit", buttons.r2, BUTTON_COLOR)) {
-            should_exit = true;
+        int index = find_sprite(WATCH.ids[i], i);
+        if (index < 0) {
+            continue;
         }
-        EndDrawing();
+        Sprite *sprite = &SPRITES.items[index];
+        if (resync && sprite_matches_record(sprite, &new, i)) {
+            continue;
+        }
+        if (sprite->version != WATCH.versions[i]) {
+            TraceLog(LOG_WARNING, "%s changed on disk, keeping local edits",
+                     sprite->name);
+            continue;
+        }
+        set_from_record(sprite, &new, i);
+        WATCH.versions[i] = sprite->version;
+        changed++;
     }
 
-    if (was_changed) {
-        char *opts[] = {
-            "Discard",
-            "Keep",
-        };
-
-        switch (button_list_popup("Discard Changes?", 2, opts, 1)) {
-        case -1:
-            goto start;
-        case 1:
-            memcpy(SPRITES.items[idx].pixels, &EDIT_BUF,
-                   SPRITE_SIZE * SPRITE_SIZE / 2);
+    // records that disappeared take their sprite with them, unless it was
+    // edited here
+    int removed = 0;
+    for (int i = new.count; i < WATCH.count; i++) {
+        int index = find_sprite(WATCH.ids[i], i);
+        if (index >= 0 && SPRITES.items[index].version == WATCH.versions[i]) {
+            SELECTED_COUNT -= SPRITES.items[index].selected;
+            free_sprite(&SPRITES.items[index]);
+            SPRITES.items[index].pixels = NULL;
+            removed++;
+        }
+    }
+    if (removed > 0) {
+        int kept = 0;
+        for (int i = 0; i < SPRITES.count; i++) {
+            if (SPRITES.items[i].pixels != NULL) {
+                SPRITES.items[kept++] = SPRITES.items[i];
+            } else {
+                shm_mark_moved(kept);
+            }
+        }
+        SPRITES.count = kept;
+        changed += removed;
+    }
 
-        case 0:
+    WATCH.ids = realloc(WATCH.ids, new.count * sizeof(unsigned));
+    WATCH.versions = realloc(WATCH.versions, new.count * sizeof(unsigned));
+    for (int i = WATCH.count; i < new.count; i++) {
+        char name[MAX_NAME_LEN];
+        name[0] = '\0';
+        if (!new.named) {
+            snprintf(name, MAX_NAME_LEN, "%d", i);
         }
+        Sprite sprite = {
+            .name = strdup(name),
+            .pixels = malloc(SPRITE_BYTES),
+            .id = NEXT_SPRITE_ID++,
+        };
+        set_from_record(&sprite, &new, i);
+        shm_mark_moved(SPRITES.count);
+        da_append(&SPRITES, sprite);
+        WATCH.ids[i] = sprite.id;
+        WATCH.versions[i] = sprite.version;
+        changed++;
     }
-    return;
+    WATCH.count = new.count;
+
+    sb_free(WATCH.image);
+    WATCH.image = image;
+    TraceLog(LOG_INFO, "reloaded %s: %d of %d sprites in %.1f ms", WATCH.path,
+             changed, new.count, (GetTime() - start) * 1000);
 }
 
-void edit_new() {
-    unsigned char *ptr = malloc(sizeof(char) * SPRITE_SIZE * SPRITE_SIZE / 2);
-    memset(ptr, 0, sizeof(char) * SPRITE_SIZE * SPRITE_SIZE / 2);
+enum {
+    MAIN_SIDEBAR,
+    MAIN_GALLERY,
+    MAIN_BUTTONS,
+    MAIN_SELECTION_BUTTONS = MAIN_BUTTONS + 6,
+    MAIN_RECTS = MAIN_SELECTION_BUTTONS + 6,
+};
 
-    if (ptr == NULL) {
-        TraceLog(LOG_FATAL, "could not allocate new sprite");
-        abort();
+void main_layout(Rectangle screen, Rectangle *rects) {
+    RectTuple main_split = vsplit(screen, 2, 5);
+    rects[MAIN_SIDEBAR] = main_split.r1;
+    rects[MAIN_GALLERY] = main_split.r2;
+    Rectangle column = main_split.r1;
+    button_column(&column, &rects[MAIN_BUTTONS], 6);
+    button_column(&column, &rects[MAIN_SELECTION_BUTTONS], 6);
+}
+
+Layout MAIN_LAYOUT = {.build = main_layout, .count = MAIN_RECTS};
+
+// Draws a full window gallery of 64 pixel sprites for the given number of
+// frames with a rectangle per pixel, with the atlas, and in software, and
+// prints the time per frame of each.
+void bench_render(int frames) {
+    const char *names[] = {"rectangles", "atlas", "software"};
+    Rectangle screen = {0, 0, GetScreenWidth(), GetScreenHeight()};
+    GALLERY.zoom = 0;
+    while (ZOOM_STEPS[GALLERY.zoom] < 4 * SPRITE_SIZE) {
+        GALLERY.zoom++;
     }
-    char *name = string_popup("Enter sprite name:", "", MAX_NAME_LEN);
-    if (name == NULL) {
-        TraceLog(LOG_FATAL, "could not allocate new sprite");
-        abort();
+    SetTargetFPS(0);
+    for (int backend = 0; backend < 3; backend++) {
+        SOFTWARE_RENDER = backend == 2;
+        double start = 0;
+        // the first frames fill the atlas and are not counted
+        int warmup = 30;
+        for (int frame = 0; frame < warmup + frames; frame++) {
+            if (frame == warmup) {
+                start = GetTime();
+            }
+            BeginDrawing();
+            ClearBackground(BACKGROUND);
+            if (backend == 0) {
+                GalleryLayout *layout = &GALLERY.layout;
+                *layout = gallery_layout(screen, GALLERY.zoom);
+                int visible_rows =
+                    ceil(layout->cells.height / layout->cell_height);
+                int last = visible_rows * layout->row_len;
+                for (int i = 0; i < last && i < SPRITES.count; i++) {
+                    Rectangle region =
+                        gallery_sprite_region(gallery_cell_rect(i));
+                    draw_sprite(SPRITES.items[i].pixels, 4, region.x,
+                                region.y, false);
+                }
+            } else {
+                sprite_selector(screen);
+            }
+            EndDrawing();
+        }
+        printf("%-10s %.2f ms per frame\n", names[backend],
+               (GetTime() - start) * 1000 / frames);
     }
-    Sprite entry = {
-        .name = name,
-        .pixels = ptr,
-    };
-    da_append(&SPRITES, entry);
-    edit_sprite(SPRITES.count - 1);
+    SOFTWARE_RENDER = false;
 }
 
-bool sprite(Rectangle rect, int sprite) {
-    Rectangle sprite_region = {
-        .x = rect.x + LITTLE_MARGIN / 2,
-        .y = rect.y + LITTLE_MARGIN / 2,
-        .width = rect.width - LITTLE_MARGIN,
-        .height = rect.width - LITTLE_MARGIN,
-    };
-    sprite_region = fit_square_factor(sprite_region, 16);
-    draw_sprite(SPRITES.items[sprite].pixels, sprite_region.width / 16,
-                sprite_region.x, sprite_region.y);
+// xorshift64*, so a stress run builds the same banks every time
+uint64_t stress_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
 
-    DrawText(SPRITES.items[sprite].name, rect.x + LITTLE_MARGIN * 3 / 2,
-             rect.y + rect.width - LITTLE_MARGIN / 2, SMALL_FONT, TEXT_COLOR);
-    return clickable_region(rect);
+// GetTime needs a window, the stress run has none
+double stress_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
 }
 
-int sprite_selector(Rectangle rect, int *page, int *num_pages) {
-    int sprite_to_edit = -1;
-    int row_len = ceil(rect.width / (16 * MAX_PIXEL_SCALE + LITTLE_MARGIN));
-    float width = rect.width / row_len;
-    float height = width + LITTLE_MARGIN + SMALL_FONT;
-    int row_count = floor(rect.height / height);
-    height = rect.height / row_count;
+// Encodes count sprites with random bitmaps, names and palettes.
+void stress_bank(String_Builder *out, int count, int version, bool named,
+                 uint64_t *rng) {
+    NAMED = named;
+    PALETTE_COUNT = 1 + stress_random(rng) % MAX_PALETTES;
+    da_reserve(&SPRITES, count);
+    for (int i = 0; i < count; i++) {
+        uint64_t *pixels = malloc(SPRITE_BYTES);
+        for (int k = 0; k < SPRITE_BYTES / 8; k++) {
+            pixels[k] = stress_random(rng);
+        }
+        uint64_t bits = stress_random(rng);
+        int len = bits % MAX_NAME_LEN;
+        char *name = malloc(len + 1);
+        for (int k = 0; k < len; k++) {
+            name[k] = 'a' + (bits >> 8) % 26 + k % 2;
+        }
+        name[len] = '\0';
+        SPRITES.items[SPRITES.count++] = (Sprite){
+            .name = name,
+            .pixels = (unsigned char *)pixels,
+            .id = NEXT_SPRITE_ID++,
+            .palette = (bits >> 16) % PALETTE_COUNT,
+        };
+    }
+    if (version == 1) {
+        encode_bank_v1(out, NULL, count);
+    } else {
+        encode_bank_v2(out, NULL, count);
+    }
+    unload_sprites();
+}
 
-    *num_pages = ceil((float)SPRITES.count / (row_count * row_len));
+enum { STRESS_REJECT = -1, STRESS_ANY = -2 };
 
-    if (*page >= *num_pages) {
-        *page = 0;
-    }
-    if (*page < 0) {
-        *page = *num_pages - 1;
+// Loads size bytes of data into an empty sprite list. expected is the count
+// it must load, STRESS_REJECT if it must be rejected or STRESS_ANY. Either
+// way the list may not have grown past what the bytes hold. Returns the
+// seconds it took, or -1 if a check failed.
+double stress_load(const unsigned char *data, size_t size, int expected) {
+    double start = stress_clock();
+    int result = load_buffer(data, size, "stress bank");
+    double seconds = stress_clock() - start;
+    size_t bound = 2 * (size / SPRITE_BYTES) + NOB_DA_INIT_CAP;
+    bool ok = (size_t)SPRITES.capacity <= bound &&
+              (result == 0 || SPRITES.capacity == 0);
+    if (expected == STRESS_REJECT) {
+        ok &= result != 0;
+    } else if (expected != STRESS_ANY) {
+        ok &= result == 0 && SPRITES.count == expected;
     }
+    unload_sprites();
+    return ok ? seconds : -1;
+}
 
-    int offset = *page * row_len * row_count;
+// Loads random banks from 1 MiB of bitmaps up to max_mib, in both versions,
+// and prints the time per byte, which has to stay flat as they grow. Every
+// bank is also loaded cut short, with flipped bytes and with forged sprite
+// counts, which must not crash or reserve memory the bytes don't back.
+// Returns 1 if a check failed.
+int stress_loader(int max_mib) {
+    const char *kinds[] = {"v1 named", "v2 named", "v2 unnamed"};
+    // smaller banks fit the caches and would make the rest look slow
+    const int steady_mib = 16;
+    uint64_t rng = 0x5eed;
+    // per kind, their records differ in bytes per sprite
+    double fastest[3] = {INFINITY, INFINITY, INFINITY};
+    double slowest[3] = {0};
+    int failed = 0;
+    SetTraceLogLevel(LOG_NONE);
+    printf("%-10s %10s %10s %10s %8s\n", "bank", "MiB", "sprites", "ms",
+           "ns/byte");
+    for (int mib = 1; mib <= max_mib; mib *= 2) {
+        int count = ((size_t)mib << 20) / SPRITE_BYTES;
+        for (int kind = 0; kind < 3; kind++) {
+            int version = kind == 0 ? 1 : 2;
+            String_Builder bank = {0};
+            stress_bank(&bank, count, version, kind != 2, &rng);
+            unsigned char *data = (unsigned char *)bank.items;
+            size_t size = bank.count;
 
-    for (int i = offset; i < SPRITES.count && i < offset + row_count * row_len;
-         i++) {
-        int x = (i - offset) % row_len;
-        int y = (i - offset) / row_len;
+            double seconds = stress_load(data, size, count);
+            if (seconds < 0) {
+                printf("%s bank of %d sprites did not load back\n",
+                       kinds[kind], count);
+                failed = 1;
+            }
+            double ns = seconds * 1e9 / size;
+            printf("%-10s %10.1f %10d %10.1f %8.2f\n", kinds[kind],
+                   size / 1048576.0, count, seconds * 1000, ns);
+            if (mib >= steady_mib || mib == max_mib) {
+                fastest[kind] = fmin(fastest[kind], ns);
+                slowest[kind] = fmax(slowest[kind], ns);
+            }
 
-        Rectangle region = {
-            .x = rect.x + x * width,
-            .y = rect.y + y * height,
-            .width = width,
-            .height = height,
-        };
-        if (sprite(region, i)) {
-            sprite_to_edit = i;
+            if (stress_load(data, stress_random(&rng) % size, STRESS_ANY) <
+                0) {
+                printf("%s bank cut short broke a check\n", kinds[kind]);
+                failed = 1;
+            }
+            size_t flips[8];
+            unsigned char masks[8];
+            for (int k = 0; k < 8; k++) {
+                flips[k] = stress_random(&rng) % size;
+                masks[k] = 1 + stress_random(&rng) % 255;
+                data[flips[k]] ^= masks[k];
+            }
+            if (stress_load(data, size, STRESS_ANY) < 0) {
+                printf("%s bank with flipped bytes broke a check\n",
+                       kinds[kind]);
+                failed = 1;
+            }
+            for (int k = 0; k < 8; k++) {
+                data[flips[k]] ^= masks[k];
+            }
+            uint32_t forged[] = {MAX_SPRITES + 1, UINT32_MAX};
+            for (int k = 0; k < 2; k++) {
+                store_le32(data + (version == 1 ? 4 : 12), forged[k]);
+                if (stress_load(data, size, STRESS_REJECT) < 0) {
+                    printf("%s bank claiming %u sprites was not rejected\n",
+                           kinds[kind], forged[k]);
+                    failed = 1;
+                }
+            }
+            sb_free(bank);
         }
     }
-    return sprite_to_edit;
+    for (int kind = 0; kind < 3; kind++) {
+        if (slowest[kind] > 4 * fastest[kind]) {
+            printf("%s load time per byte grew from %.2f to %.2f ns\n",
+                   kinds[kind], fastest[kind], slowest[kind]);
+            failed = 1;
+        }
+    }
+    SetTraceLogLevel(LOG_WARNING);
+    return failed;
 }
 
+#ifndef SPREDIT_FUZZ
 int main(int argc, char *argv[]) {
     SetTraceLogLevel(LOG_WARNING);
+
+    char *file_name = 0;
+    File_Paths imports = {0};
+    ImportPalette import_palette = IMPORT_MATCH_PALETTE;
+    ImportDither import_dither = DITHER_NONE;
+    // when set, the imports are written here without opening a window
+    const char *output = NULL;
+    // same for exporting the whole bank as PNG, see export_png
+    const char *png_output = NULL;
+    // and as a packed atlas, see export_atlas
+    const char *atlas_output = NULL;
+    // and as a texture, see export_texture
+    const char *texture_output = NULL;
+    // frames per backend for bench_render
+    int bench_frames = 0;
+    // largest bank for stress_loader, in MiB of bitmaps
+    int stress_mib = 0;
+    TextureFormat texture_format = TEXTURE_RGBA8;
+    bool mips = true;
+    ManifestFormat manifest = MANIFEST_JSON;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (has_value && strcmp(argv[i], "--prefetch-pages") == 0) {
+            PREFETCH.pages = atoi(argv[++i]);
+        } else if (has_value && strcmp(argv[i], "--prefetch-budget") == 0) {
+            // in MiB
+            PREFETCH.budget = (size_t)atoi(argv[++i]) << 20;
+        } else if (has_value && strcmp(argv[i], "--import") == 0) {
+            da_append(&imports, argv[++i]);
+        } else if (strcmp(argv[i], "--build-palette") == 0) {
+            import_palette = IMPORT_BUILD_PALETTE;
+        } else if (has_value && strcmp(argv[i], "--dither") == 0) {
+            i++;
+            if (strcmp(argv[i], "ordered") == 0) {
+                import_dither = DITHER_ORDERED;
+            } else if (strcmp(argv[i], "diffusion") == 0) {
+                import_dither = DITHER_DIFFUSION;
+            } else if (strcmp(argv[i], "none") != 0) {
+                TraceLog(LOG_ERROR, "--dither is none, ordered or diffusion");
+                return 1;
+            }
+        } else if (has_value && strcmp(argv[i], "--output") == 0) {
+            output = argv[++i];
+        } else if (has_value && strcmp(argv[i], "--export-png") == 0) {
+            png_output = argv[++i];
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            manifest = MANIFEST_CSV;
+        } else if (has_value && strcmp(argv[i], "--png-level") == 0) {
+            // 0 to 9, like zlib
+            PNG_LEVEL = Clamp(atoi(argv[++i]), 0, 9);
+        } else if (has_value && strcmp(argv[i], "--export-atlas") == 0) {
+            atlas_output = argv[++i];
+        } else if (has_value && strcmp(argv[i], "--atlas-size") == 0) {
+            // rounded up to a power of two that holds a padded sprite
+            int size = atoi(argv[++i]);
+            ATLAS_PAGE_SIZE = 2 * SPRITE_SIZE;
+            while (ATLAS_PAGE_SIZE < size && ATLAS_PAGE_SIZE < 16384) {
+                ATLAS_PAGE_SIZE *= 2;
+            }
+        } else if (has_value && strcmp(argv[i], "--atlas-padding") == 0) {
+            ATLAS_PADDING = Clamp(atoi(argv[++i]), 0, SPRITE_SIZE);
+        } else if (has_value && strcmp(argv[i], "--export-texture") == 0) {
+            texture_output = argv[++i];
+        } else if (has_value && strcmp(argv[i], "--texture-format") == 0) {
+            i++;
+            if (strcmp(argv[i], "r8") == 0) {
+                texture_format = TEXTURE_R8;
+            } else if (strcmp(argv[i], "rgba8") != 0) {
+                TraceLog(LOG_ERROR, "--texture-format is rgba8 or r8");
+                return 1;
+            }
+        } else if (has_value && strcmp(argv[i], "--texture-size") == 0) {
+            // rounded up to a power of two
+            int size = atoi(argv[++i]);
+            TEXTURE_PAGE_SIZE = SPRITE_SIZE;
+            while (TEXTURE_PAGE_SIZE < size && TEXTURE_PAGE_SIZE < 16384) {
+                TEXTURE_PAGE_SIZE *= 2;
+            }
+        } else if (strcmp(argv[i], "--no-mips") == 0) {
+            mips = false;
+        } else if (strcmp(argv[i], "--software-render") == 0) {
+            SOFTWARE_RENDER = true;
+        } else if (has_value && strcmp(argv[i], "--bench-render") == 0) {
+            bench_frames = atoi(argv[++i]);
+        } else if (has_value && strcmp(argv[i], "--stress") == 0) {
+            // banks beyond MAX_SPRITES are rejected, not loaded
+            stress_mib = Clamp(atoi(argv[++i]), 0,
+                               ((size_t)MAX_SPRITES * SPRITE_BYTES) >> 20);
+        } else if (strcmp(argv[i], "--save-v1") == 0) {
+            // for tools that only read the first layout
+            SAVE_VERSION = 1;
+        } else if (has_value && strcmp(argv[i], "--shm") == 0) {
+            // POSIX shm names start with a slash
+            SHM.name = argv[++i];
+        } else if (file_name == NULL) {
+            file_name = argv[i];
+        } else {
+            TraceLog(LOG_ERROR, "invalid arguments");
+            return 1;
+        }
+    }
+
+    if (stress_mib > 0) {
+        return stress_loader(stress_mib);
+    }
+    if (output || png_output || atlas_output || texture_output) {
+        if (file_name && load_file(file_name) != 0) {
+            return 1;
+        }
+        da_foreach(const char *, path, &imports) {
+            if (import_sheet(*path, import_palette, import_dither) < 0) {
+                return 1;
+            }
+        }
+        int result = 0;
+        if (output && write_file(output) != 0) {
+            result = 1;
+        }
+        size_t len = png_output ? strlen(png_output) : 0;
+        if (len > 4 && strcmp(png_output + len - 4, ".png") == 0) {
+            if (export_png_sheet(png_output, NULL, SPRITES.count, manifest) !=
+                0) {
+                result = 1;
+            }
+        } else if (png_output &&
+                   export_png_files(png_output, NULL, SPRITES.count) != 0) {
+            result = 1;
+        }
+        if (atlas_output &&
+            export_atlas(atlas_output, NULL, SPRITES.count, manifest) != 0) {
+            result = 1;
+        }
+        if (texture_output &&
+            export_texture(texture_output, NULL, SPRITES.count,
+                           texture_format, mips) != 0) {
+            result = 1;
+        }
+        da_free(imports);
+        clear_undo();
+        unload_sprites();
+        return result;
+    }
+
     InitWindow(WIDTH, HEIGHT, "Spredit");
     SetWindowState(FLAG_WINDOW_RESIZABLE);
     SetTargetFPS(100);
     // just to disable close on esc
     SetExitKey(KEY_F10);
+    thumb_pool_start();
 
-    char *file_name = 0;
-
-    switch (argc) {
-    case 1:
-        break;
-    case 2:
-        file_name = argv[1];
-        load_file(argv[1]);
-        break;
-    case 3:
-        TraceLog(LOG_ERROR, "invalid arguments");
-        return 1;
+    if (file_name && load_file(file_name) == 0) {
+        watch_file(file_name);
+    }
+    da_foreach(const char *, path, &imports) {
+        import_sheet(*path, import_palette, import_dither);
+    }
+    da_free(imports);
+    if (bench_frames > 0) {
+        bench_render(bench_frames);
     }
 
-    bool should_quit = false;
-    int page = 0;
-    int num_pages = 0;
+    Layout *layout = &MAIN_LAYOUT;
+    CachedString counts_text = {0};
+    CachedString stats_text = {0};
+    bool should_quit = bench_frames > 0;
     while (!should_quit) {
         should_quit = WindowShouldClose();
-        if (IsKeyPressed(KEY_RIGHT) || IsKeyPressed(KEY_DOWN)) {
-            page += 1;
+        if (IsWindowResized()) {
+            text_cache_clear();
         }
-        if (IsKeyPressed(KEY_LEFT) || IsKeyPressed(KEY_UP)) {
-            page -= 1;
+        if (watch_poll()) {
+            reload_changes();
         }
+        gallery_shortcuts();
+        software_render_shortcut();
+        shm_publish();
+        Rectangle *rects = layout_begin(layout);
+        atlas_begin_frame();
         BeginDrawing();
         ClearBackground(BACKGROUND);
 
-        Rectangle main_region = setup_screen("Spredit");
-
-        RectTuple main_split = vsplit(main_region, 2, 5);
+        draw_title("Spredit");
 
         char *buttons[] = {
-            "Edit Palette", "New Sprite", "Save Changes", "Save As", "Quit",
+            "Edit Palette", "New Sprite", "Import Sheet",
+            "Save Changes", "Save As",    "Quit",
+        };
+
+        int result = layout_button_list(layout, MAIN_BUTTONS, buttons, 6);
+
+        char *selection_buttons[] = {
+            "Delete Selected",
+            "Duplicate Selected",
+            "Rename Selected",
+            "Export Selected",
+            "Export PNG",
+            "Export Atlas",
         };
+        int selection_result = -1;
+        if (SELECTED_COUNT > 0) {
+            selection_result = layout_button_list(
+                layout, MAIN_SELECTION_BUTTONS, selection_buttons, 6);
+        }
+        Rectangle sidebar = rects[MAIN_SIDEBAR];
 
-        int result = button_list(&main_split.r1, buttons, 5);
+        double counts[] = {
+            SPRITES.count,
+            SELECTED_COUNT,
+            PREFETCH.last_row + 1,
+            gallery_total_rows(),
+            GALLERY.layout.sprite_size * 100 / SPRITE_SIZE,
+            GALLERY_PALETTE,
+        };
+        if (cached_string_stale(&counts_text, counts, ARRAY_LEN(counts))) {
+            snprintf(counts_text.text, sizeof(counts_text.text),
+                     "%d Sprites, %d selected\nRow %d/%d, zoom %d%%%s",
+                     (int)counts[0], (int)counts[1], (int)counts[2],
+                     (int)counts[3], (int)counts[4],
+                     counts[5] >= 0
+                         ? TextFormat(", palette %d", (int)counts[5] + 1)
+                         : "");
+        }
+        draw_text(counts_text.text, sidebar.x,
+                  sidebar.y + sidebar.height - 2 * MEDIUM_FONT,
+                  MEDIUM_FONT, sidebar.width, TEXT_COLOR);
 
-        DrawText(TextFormat("%d Sprites\nPage %d/%d", SPRITES.count, page + 1,
-                            num_pages),
-                 main_split.r1.x,
-                 main_split.r1.y + main_split.r1.height - 2 * MEDIUM_FONT,
-                 MEDIUM_FONT, TEXT_COLOR);
+        // rounded to what is shown so the string is rebuilt only when it
+        // visibly changes
+        double stats[] = {
+            round(FILL_LATENCY * 10000) / 10,
+            thumb_queue_depth(),
+            round(GALLERY_TIME * 10000) / 10,
+            SOFTWARE_RENDER,
+        };
+        if (cached_string_stale(&stats_text, stats, ARRAY_LEN(stats))) {
+            snprintf(stats_text.text, sizeof(stats_text.text),
+                     "fill latency %.1f ms, queue %d, draw %.1f ms%s",
+                     stats[0], (int)stats[1], stats[2],
+                     stats[3] ? " (software)" : "");
+        }
+        draw_text(stats_text.text, sidebar.x,
+                  sidebar.y + sidebar.height - 3 * MEDIUM_FONT,
+                  SMALL_FONT, sidebar.width, TEXT_COLOR);
 
         if (file_name) {
-            DrawText(TextFormat("File: %s", file_name), main_split.r1.x,
-                     main_split.r1.y + main_split.r1.height - 3 * MEDIUM_FONT,
-                     MEDIUM_FONT, TEXT_COLOR);
+            float y = sidebar.y + sidebar.height - 4 * MEDIUM_FONT;
+            float label = draw_text("File: ", sidebar.x, y, MEDIUM_FONT,
+                                    0, TEXT_COLOR);
+            draw_text(file_name, sidebar.x + label, y, MEDIUM_FONT,
+                      sidebar.width - label, TEXT_COLOR);
         }
 
-        int sprite_to_edit = sprite_selector(main_split.r2, &page, &num_pages);
+        int sprite_to_edit = sprite_selector(rects[MAIN_GALLERY]);
 
         EndDrawing();
 
         switch (result) {
         case 0:
-            edit_colors();
+            edit_colors(gallery_top());
             break;
         case 1:
             edit_new();
             break;
-        case 3:
-            file_name = NULL;
         case 2:
+            import_sheet_popup();
+            break;
+        case 4:
+            file_name = NULL;
+        case 3:
             if (file_name == NULL) {
                 file_name = string_popup("Enter file name", "", 64);
             }
             if (file_name != NULL && write_file(file_name) != 0) {
                 return 1;
             }
+            if (file_name != NULL) {
+                watch_file(file_name);
+            }
             break;
-        case 4:
+        case 5:
             should_quit = true;
             break;
         }
 
+        switch (selection_result) {
+        case 0:
+            delete_selected();
+            break;
+        case 1:
+            duplicate_selected();
+            break;
+        case 2: {
+            char *pattern =
+                string_popup("Rename, # is replaced by a number", "#",
+                             MAX_NAME_LEN);
+            if (pattern != NULL) {
+                rename_selected(pattern);
+                free(pattern);
+            }
+        } break;
+        case 3:
+            export_selected();
+            break;
+        case 4:
+            export_selected_png();
+            break;
+        case 5:
+            export_selected_atlas();
+            break;
+        }
+
         if (sprite_to_edit != -1) {
             edit_sprite(sprite_to_edit);
         }
     }
+    unwatch_file();
+    shm_unpublish();
+    thumb_pool_stop();
+    atlas_unload();
+    framebuffer_unload();
     CloseWindow();
+    clear_undo();
     unload_sprites();
 }
+#endif
@@ -5,15 +5,25 @@
 int main(int argc, char **argv) {
     NOB_GO_REBUILD_URSELF(argc, argv);
 
+    // `./nob fuzz` builds the bank loader fuzzer, run as `./fuzz corpus/`
+    bool fuzz = argc > 1 && strcmp(argv[1], "fuzz") == 0;
+
     Cmd cmd = {0};
     cmd_append(&cmd, "clang");
-    cmd_append(&cmd, "-Wall", "-Wextra", "-std=c23", "-o", "main", "main.c");
+    cmd_append(&cmd, "-Wall", "-Wextra", "-std=c23");
+    if (fuzz) {
+        cmd_append(&cmd, "-g", "-O1", "-DSPREDIT_FUZZ",
+                   "-fsanitize=fuzzer,address,undefined", "-o", "fuzz");
+    } else {
+        cmd_append(&cmd, "-o", "main");
+    }
+    cmd_append(&cmd, "main.c");
 
     cmd_append(&cmd, "-I/opt/homebrew/include", "-L/opt/homebrew/lib");
 
-    cmd_append(&cmd, "-lraylib", "-framework", "CoreVideo", "-framework",
-               "IOKit", "-framework", "Cocoa", "-framework", "GLUT",
-               "-framework", "OpenGL");
+    cmd_append(&cmd, "-lraylib", "-lz", "-framework", "CoreVideo",
+               "-framework", "IOKit", "-framework", "Cocoa", "-framework",
+               "GLUT", "-framework", "OpenGL");
     if (!cmd_run_sync(cmd))
         return 1;
     return 0;
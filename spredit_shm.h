@@ -0,0 +1,158 @@
+// Layout of the shared memory segment spredit publishes with `--shm NAME`,
+// and the read side for programs that want sprite edits as they are saved.
+//
+// The segment starts with a SpreditShm block. At image_offset follows the
+// store in the sprt file layout: the 72 byte header with the sprite count and
+// palette 0, then one 192 byte record (64 byte name, 128 byte bitmap) per
+// sprite, with room for capacity records. At palettes_offset follow the
+// palette count as a little endian uint32 and every palette, at
+// sprite_palettes_offset one byte per record with the palette it is drawn
+// in, and at seq_offset one sequence counter per record.
+//
+// Every counter is a seqlock. It is odd while spredit writes the record and
+// its palette byte and moves on to a new even value when the write is done,
+// so a reader that saw the same even value before and after copying got a
+// consistent record. header_seq guards the header and the palettes the same
+// way.
+//
+//     int fd = shm_open("/spredit", O_RDONLY, 0);
+//     struct stat st;
+//     fstat(fd, &st);
+//     SpreditShm *shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+//     uint32_t palettes_seen = 0;
+//     unsigned char palettes[SPREDIT_SHM_PALETTES_BYTES];
+//     uint32_t seen[MAX_SPRITES] = {0};
+//     unsigned char record[SPREDIT_SHM_RECORD_BYTES];
+//     unsigned char palette;
+//     // once per frame
+//     spredit_shm_read_palettes(shm, &palettes_seen, palettes);
+//     for (uint32_t i = 0; i < count; i++) {
+//         if (spredit_shm_read_sprite(shm, i, &seen[i], record, &palette)) {
+//             // upload record + SPREDIT_SHM_NAME_LEN in palette
+//         }
+//     }
+//
+// When the store outgrows the segment, spredit creates a new one under the
+// same name and sets retired in the old one. Readers then map it again.
+#ifndef SPREDIT_SHM_H
+#define SPREDIT_SHM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// version 1 had palette 0 only
+#define SPREDIT_SHM_MAGIC "sprshm2"
+
+enum {
+    SPREDIT_SHM_HEADER_BYTES = 72,
+    SPREDIT_SHM_NAME_LEN = 64,
+    SPREDIT_SHM_PIXEL_BYTES = 128,
+    SPREDIT_SHM_RECORD_BYTES = SPREDIT_SHM_NAME_LEN + SPREDIT_SHM_PIXEL_BYTES,
+    SPREDIT_SHM_COLORS = 16,
+    SPREDIT_SHM_MAX_PALETTES = 16,
+    // the count, then room for every palette of 16 RGBA colors
+    SPREDIT_SHM_PALETTES_BYTES =
+        4 + SPREDIT_SHM_MAX_PALETTES * SPREDIT_SHM_COLORS * 4,
+};
+
+typedef struct {
+    char magic[8];
+    // records there is room for
+    uint32_t capacity;
+    // from the start of the segment
+    uint32_t image_offset;
+    uint32_t palettes_offset;
+    uint32_t sprite_palettes_offset;
+    uint32_t seq_offset;
+    // set once spredit moved on to a bigger segment
+    _Atomic uint32_t retired;
+    // seqlock over the sprt header, the sprite count and the palettes
+    _Atomic uint32_t header_seq;
+} SpreditShm;
+
+static inline unsigned char *spredit_shm_image(SpreditShm *shm) {
+    return (unsigned char *)shm + shm->image_offset;
+}
+
+static inline unsigned char *spredit_shm_record(SpreditShm *shm,
+                                                uint32_t index) {
+    return spredit_shm_image(shm) + SPREDIT_SHM_HEADER_BYTES +
+           (size_t)index * SPREDIT_SHM_RECORD_BYTES;
+}
+
+static inline unsigned char *spredit_shm_palettes(SpreditShm *shm) {
+    return (unsigned char *)shm + shm->palettes_offset;
+}
+
+static inline unsigned char *spredit_shm_sprite_palettes(SpreditShm *shm) {
+    return (unsigned char *)shm + shm->sprite_palettes_offset;
+}
+
+static inline _Atomic uint32_t *spredit_shm_seqs(SpreditShm *shm) {
+    return (_Atomic uint32_t *)((unsigned char *)shm + shm->seq_offset);
+}
+
+// False if nothing changed since *seen or a write is going on, otherwise the
+// caller copies and checks with spredit_shm_read_end.
+static inline bool spredit_shm_read_begin(_Atomic uint32_t *seq,
+                                          uint32_t seen, uint32_t *before) {
+    *before = atomic_load_explicit(seq, memory_order_acquire);
+    return !(*before & 1) && *before != seen;
+}
+
+static inline bool spredit_shm_read_end(_Atomic uint32_t *seq,
+                                        uint32_t before, uint32_t *seen) {
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(seq, memory_order_relaxed) != before) {
+        return false;
+    }
+    *seen = before;
+    return true;
+}
+
+// Copies the 72 byte sprt header if it changed since *seen, which starts out
+// as 0. Returns false if it did not change or is being written right now.
+static inline bool spredit_shm_read_header(SpreditShm *shm, uint32_t *seen,
+                                           unsigned char *out) {
+    uint32_t before;
+    if (!spredit_shm_read_begin(&shm->header_seq, *seen, &before)) {
+        return false;
+    }
+    memcpy(out, spredit_shm_image(shm), SPREDIT_SHM_HEADER_BYTES);
+    return spredit_shm_read_end(&shm->header_seq, before, seen);
+}
+
+// Same for the palette count and the palettes. Use another *seen than for
+// the header, they share the counter.
+static inline bool spredit_shm_read_palettes(SpreditShm *shm, uint32_t *seen,
+                                             unsigned char *out) {
+    uint32_t before;
+    if (!spredit_shm_read_begin(&shm->header_seq, *seen, &before)) {
+        return false;
+    }
+    memcpy(out, spredit_shm_palettes(shm), SPREDIT_SHM_PALETTES_BYTES);
+    return spredit_shm_read_end(&shm->header_seq, before, seen);
+}
+
+// Copies record index and its palette if they changed since *seen, which
+// starts out as 0. Returns false if they did not change or are being written
+// right now, in which case the next call picks them up.
+static inline bool spredit_shm_read_sprite(SpreditShm *shm, uint32_t index,
+                                           uint32_t *seen, unsigned char *out,
+                                           unsigned char *palette) {
+    if (index >= shm->capacity) {
+        return false;
+    }
+    _Atomic uint32_t *seq = &spredit_shm_seqs(shm)[index];
+    uint32_t before;
+    if (!spredit_shm_read_begin(seq, *seen, &before)) {
+        return false;
+    }
+    memcpy(out, spredit_shm_record(shm, index), SPREDIT_SHM_RECORD_BYTES);
+    *palette = spredit_shm_sprite_palettes(shm)[index];
+    return spredit_shm_read_end(seq, before, seen);
+}
+
+#endif // SPREDIT_SHM_H